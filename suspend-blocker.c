@@ -23,12 +23,32 @@
 #include <stdbool.h>
 #include <stdarg.h>
 #include <string.h>
+#include <ctype.h>
 #include <errno.h>
 #include <unistd.h>
 #include <time.h>
 #include <float.h>
 #include <signal.h>
-#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <pthread.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <getopt.h>
+#include <sys/inotify.h>
+#include <sys/timerfd.h>
+#include <dirent.h>
+#if defined(HAVE_ZLIB)
+#define ZLIB_CONST
+#include <zlib.h>
+#endif
+#if defined(HAVE_LZMA)
+#include <lzma.h>
+#endif
+#if defined(HAVE_ZSTD)
+#include <zstd.h>
+#endif
 #include <json.h>
 #include <math.h>
 #include <inttypes.h>
@@ -47,6 +67,9 @@
 #define STATE_RESUME_CAUSE              0x00000100
 #define STATE_FREEZE_TASKS_REFUSE	0x00000200
 #define STATE_SUSPEND_FAIL_CAUSE	0x00000400
+#define STATE_FREEZING_USER		0x00000800
+#define STATE_FREEZING_TASKS		0x00001000
+#define STATE_ALL			(~0)
 
 #define OPT_WAKELOCK_BLOCKERS		0x00000001
 #define OPT_VERBOSE			0x00000002
@@ -56,14 +79,45 @@
 #define OPT_PROC_WAKELOCK		0x00000020
 #define OPT_HISTOGRAM_DECADES		0x00000040
 #define OPT_FREQUENCY_REPORT		0x00000080
-
-#define HASH_SIZE			(1997)
+#define OPT_FOLLOW			0x00000100
+#define OPT_KMSG			0x00000200
+#define OPT_SKETCH			0x00000400
+#define OPT_HISTOGRAM_PRECISION		0x00000800
+#define OPT_SAVE_INDEX			0x00001000
+#define OPT_SINCE			0x00002000
+#define OPT_UNTIL			0x00004000
+#define OPT_WAKELOCK_SAMPLE		0x00008000
+#define OPT_PHASES			0x00010000
+#define OPT_CALLBACKS			0x00020000
+#define OPT_STORMS			0x00040000
+
+#define STRTAB_MIN_SLOTS		(64)
+
+/* Suspend reasons, cause set id << 2 | prefix */
+#define REASON_NONE			(-1)
+#define REASON_RESUMED			(0)	/* R: */
+#define REASON_ABORTED			(1)	/* A: */
+#define REASON_FAILED			(2)	/* F: */
 #define MAX_INTERVALS			(30)
 
+#define HISTOGRAM_DIGITS		(2)		/* default significant digits */
+#define HISTOGRAM_UNIT_SHIFT		(20)		/* values in 2^-20 second units */
+#define HISTOGRAM_MAX_SHIFT		(44)		/* up to 2^24 seconds, ~194 days */
+#define HISTOGRAM_FIRST_SHIFT		(17)		/* 0.125 seconds, first row */
+
+#define SKETCH_ALPHA			(0.01)		/* quantile relative error */
+#define SKETCH_LOG_GAMMA		(log((1.0 + SKETCH_ALPHA) / (1.0 - SKETCH_ALPHA)))
+#define SKETCH_MIN			(0.000001)	/* smallest value binned, 1us */
+#define SKETCH_BINS			(1600)		/* log bins, 1us to ~2.5 years */
+#define SKETCH_MODE_BINS		(4096)		/* 1/2 second mode bins, to 2048s */
+#define CALLBACK_BINS_PER_2		(8)		/* device callback bins per power of 2 */
+#define CALLBACK_BINS			(256)		/* 1us to ~71 minutes */
+
 #define WAKELOCK_START			(0)
 #define WAKELOCK_END			(1)
 
 #define WAKELOCK_NAME_SZ		(128)
+#define WAKELOCK_SAMPLES		(1024)		/* -I intervals kept for JSON */
 #define MS				(1000.0)
 
 #define SUSPEND_SUCCESS			(0)
@@ -76,24 +130,30 @@
 /*
  *  Calculate wakelock delta between start and end epoc
  */
-#define WL_DELTA(i, f)					\
-	((double)(wakelocks[i]->stats[WAKELOCK_END].f -	\
-	 (double)wakelocks[i]->stats[WAKELOCK_START].f))
+#define WL_DELTA(wl, f)					\
+	((double)((wl)->stats[WAKELOCK_END].f -		\
+	 (double)(wl)->stats[WAKELOCK_START].f))
 
 #define NO_NEG(v) ((v) < 0.0 ? 0.0 : (v))
 
 #define FREQ_SIZE	(100)
 
-typedef struct {
-	unsigned int	succeed_count;
-	unsigned int	failed_count;
-	unsigned int	*reason_counts;
-} freq_info_t;
+#define MATCHER_OUTPUT	(0x80000000)	/* DFA state reports a match */
+
+#define CHUNK_MIN_SIZE	(1024 * 1024)	/* smallest chunk worth a thread */
+#define DECOMP_BLOCK_SIZE (256 * 1024)	/* decompressed text block size */
+#define DECOMP_BLOCKS	(4)		/* blocks between decompressor and parser */
+#define FOLLOW_BUF_SIZE	(64 * 1024)	/* follow and kmsg read size */
+#define KMSG_DEVICE	"/dev/kmsg"
+#define WINDOW_LOOKBACK	(64 * 1024)	/* warm up parsed before a -t window */
 
-typedef struct reason {
-	char *reason;
-	struct reason *next;
-} reason_t;
+#define INDEX_MAGIC	"SBINDEX"	/* index file magic, with its NUL */
+#define INDEX_VERSION	(1)		/* bumped on any index layout change */
+#define INDEX_BYTE_ORDER (0x01020304)	/* written in native byte order */
+#define INDEX_NEEDS_CONFIG_SUSPEND_TIME	(0x00000001)
+#define INDEX_KMSG			(0x00000002)
+#define INDEX_MAX_TIME	(4294967296.0)	/* later times are corrupt, 2106 */
+#define MAX_THREADS	(1024)
 
 typedef struct {
 	uint64_t	active_count;	/* active count (not used in this tool) */
@@ -110,10 +170,28 @@ typedef struct {
 } wakelock_stats;
 
 typedef struct {
-	char 		*name;		/* name of wakelock */
+	const char	*name;		/* name of wakelock */
 	wakelock_stats	stats[2];	/* wakelock start + end stats */
+	wakelock_stats	last;		/* stats at the last -I sample */
 } wakelock_info;
 
+typedef struct {
+	uint32_t	id;		/* wakelock name id */
+	uint64_t	count;		/* unlock count delta */
+	uint64_t	wakeup_count;	/* wakeup count delta */
+	double		total_time;	/* total time delta, ms */
+	double		prevent_time;	/* prevent suspend time delta, ms */
+} wakelock_delta;
+
+typedef struct {
+	double		start;		/* interval start, seconds into run */
+	double		end;		/* interval end, seconds into run */
+	double		awake;		/* seconds awake in the interval */
+	wakelock_delta	*deltas;	/* wakelocks that changed */
+	uint32_t	n;		/* number of deltas */
+	uint32_t	size;		/* deltas allocated */
+} wakelock_sample;
+
 typedef struct {
 	double	whence;
 	bool	whence_valid;		/* whence time is valid or not? */
@@ -123,23 +201,555 @@ typedef struct {
 } timestamp;
 
 typedef struct {
-	char *name;			/* name of counter */
-	int  count;			/* number of times detected */
+	uint32_t	hash;		/* hash of string */
+	uint32_t	id;		/* string id + 1, 0 if slot is free */
+} strtab_slot_t;
+
+typedef struct {
+	char		**strs;		/* interned strings, indexed by id */
+	strtab_slot_t	*slots;		/* open addressed hash of the strings */
+	uint32_t	count;		/* number of strings */
+	uint32_t	size;		/* size of strs */
+	uint32_t	nslots;		/* number of slots, a power of 2 */
+} strtab_t;
+
+typedef struct {
+	strtab_t	*names;		/* names the counts are indexed by */
+	int		*counts;	/* counts, indexed by name id */
+	uint32_t	size;		/* size of counts */
 } counter_info;
 
-typedef struct time_delta_info {
-	int    type;			/* info type */
-	double start;			/* time it started */
-	char   *reason;			/* resume reason */
-	double delta;
-	bool   accurate;		/* accurate or not? */
-	struct time_delta_info *next;
-} time_delta_info;
+typedef struct {
+	const char	*name;		/* name of counter */
+	int		count;		/* number of times detected */
+} counter_entry;
+
+typedef struct {
+	uint64_t	count;		/* number of values added */
+	uint64_t	low;		/* values below SKETCH_MIN */
+	double		min;		/* smallest value */
+	double		max;		/* largest value */
+	double		sum;		/* sum of values */
+	uint32_t	bins[SKETCH_BINS]; /* values in (gamma^(i-1), gamma^i] x SKETCH_MIN */
+	uint32_t	mode[SKETCH_MODE_BINS]; /* values rounded to 1/2 second */
+} sketch_t;
+
+typedef struct {
+	uint32_t	*counts;	/* values in each bucket */
+	double		*sums;		/* sum of the values in each bucket */
+	uint32_t	size;		/* number of buckets */
+	uint32_t	total;		/* number of values */
+	uint32_t	accurate;	/* number of accurate values */
+	int		half_magnitude;	/* log2 of half the sub-buckets per bucket */
+} histogram_t;
+
+typedef struct {
+	histogram_t	intervals;	/* time between successful suspends */
+	histogram_t	durations;	/* duration of successful suspends */
+} histograms_t;
+
+/*
+ *  Suspend and resume phases with latencies in the kernel log, -p
+ */
+enum {
+	PHASE_FREEZE_USER,
+	PHASE_FREEZE_TASKS,
+	PHASE_SUSPEND,
+	PHASE_SUSPEND_LATE,
+	PHASE_SUSPEND_NOIRQ,
+	PHASE_RESUME_NOIRQ,
+	PHASE_RESUME_EARLY,
+	PHASE_RESUME,
+	PHASE_MAX
+};
+
+typedef struct {
+	const char	*name;		/* name in rules and JSON */
+	const char	*text;		/* name in the report */
+} phase_name_t;
+
+typedef struct {
+	sketch_t	sketch;		/* latencies, for min, mean and p99 */
+	histogram_t	histogram;	/* latencies, -H */
+} phase_stats_t;
+
+typedef struct {
+	uint32_t	count;		/* number of callbacks */
+	double		total;		/* sum of latencies */
+	double		max;		/* largest latency */
+	uint32_t	*bins;		/* latencies in 2^(i/CALLBACK_BINS_PER_2) us bins */
+} callback_stat_t;
+
+typedef struct {
+	uint32_t	device;		/* device id */
+	int		phase;		/* phase the callback ran in */
+	const callback_stat_t *stat;
+} callback_entry;
+
+typedef struct {
+	double		*times;		/* ring of the last opt_storm_count wakeups */
+	uint32_t	head;		/* oldest wakeup in times */
+	uint32_t	n;		/* wakeups in times */
+	int		storm;		/* storm in progress, -1 if none */
+} storm_key_t;
+
+typedef struct {
+	uint32_t	key;		/* name id * 2, + 1 for a wakeup source */
+	double		start;		/* first wakeup of the storm */
+	double		end;		/* last wakeup of the storm */
+	uint32_t	count;		/* wakeups in the storm */
+	bool		wall;		/* times are wall clock, not kernel time */
+} storm_t;
+
+typedef struct {
+	double		q;		/* quantile */
+	const char	*text;		/* name in the report */
+	const char	*key;		/* name in JSON keys */
+} percentile_t;
+
+typedef struct {
+	double		*start;		/* time each event started */
+	double		*delta;		/* interval or duration of each event */
+	int32_t		*reason;	/* REASON_* prefix and cause set */
+	uint8_t		*type;		/* SUSPEND_* event type */
+	uint8_t		*accurate;	/* delta accurate or not? */
+	size_t		n;		/* number of events */
+	size_t		size;		/* size of the columns */
+	bool		mapped;		/* columns are in an index mapping */
+} events_t;
+
+typedef struct {
+	uint32_t	*next;		/* DFA transitions, states x classes */
+	int32_t		*out;		/* pattern id ending at state, -1 if none */
+	uint32_t	*dict;		/* next state on fail chain with output */
+	char		**patterns;	/* pattern text, indexed by pattern id */
+	size_t		*lengths;	/* pattern lengths */
+	uint32_t	npatterns;	/* number of patterns */
+	uint32_t	states;		/* number of DFA states */
+	uint32_t	classes;	/* number of byte classes */
+	uint8_t		class[256];	/* byte to class map */
+} matcher_t;
+
+typedef struct {
+	uint32_t	*seen;		/* generation pattern was last seen in */
+	size_t		*offset;	/* offset of first occurrence in line */
+	uint32_t	generation;	/* current line generation */
+	uint32_t	hits;		/* number of patterns found in line */
+} matches_t;
+
+typedef struct {
+	const char	*filename;	/* name of kernel log */
+	void		*index;		/* index mapping, --index, event columns */
+	size_t		index_size;	/* size of index mapping */
+	matches_t	matches;	/* markers found in current line */
+	char		*buf;		/* copy of current line being parsed */
+	size_t		buf_size;	/* size of buf */
+	char		*partial;	/* partial line carried between blocks */
+	size_t		partial_len;	/* length of partial line */
+	size_t		partial_size;	/* size of partial */
+	char		wakelock[4096];	/* last active wakelock */
+	uint32_t	*causes;	/* resume cause ids of current suspend */
+	uint32_t	ncauses;	/* number of resume causes */
+	uint32_t	causes_size;	/* size of causes */
+	int		suspend_fail_cause; /* cause id of current suspend failure */
+	int		state;		/* suspend state machine state */
+	timestamp	suspend_start;	/* when current suspend started */
+	timestamp	suspend_exit;	/* when current suspend exited */
+	double		last_exit;	/* when last successful suspend exited */
+	double		suspend_duration_parsed; /* "Suspended for" duration */
+	int		suspend_succeeded; /* number of successful suspends */
+	int		suspend_failed;	/* number of failed suspends */
+	bool		needs_config_suspend_time; /* no CONFIG_SUSPEND_TIME data */
+	events_t	suspend_list;	/* awake intervals and failures */
+	events_t	suspend_duration_list; /* suspend durations */
+	sketch_t	interval_sketch; /* awake intervals, -S */
+	sketch_t	suspend_sketch;	/* suspend durations, -S */
+	histograms_t	histograms;	/* awake and suspend histograms, -H */
+	phase_stats_t	*phases;	/* suspend phase latencies, -p */
+	double		phase_times[PHASE_MAX]; /* latencies of current suspend */
+	uint32_t	phase_seen;	/* phases seen in current suspend */
+	int		device_phase;	/* phase device callbacks are in, -c */
+	callback_stat_t	*callbacks;	/* latencies by device id and phase, -c */
+	uint32_t	callbacks_size;	/* size of callbacks */
+	strtab_t	devices;	/* names of devices, -c */
+	storm_key_t	*storm_keys;	/* wakeup windows by key, -W */
+	uint32_t	storm_keys_size; /* size of storm_keys */
+	uint32_t	*storm_pending;	/* keys of wakeups in current suspend */
+	uint32_t	storm_npending;	/* number of storm_pending */
+	uint32_t	storm_pending_size; /* size of storm_pending */
+	storm_t		*storms;	/* wakeup storms found, -W */
+	uint32_t	nstorms;	/* number of storms */
+	uint32_t	storms_size;	/* size of storms */
+	strtab_t	names;		/* names of causes and counters */
+	strtab_t	sets;		/* sets of cause ids, "id+id..." */
+	counter_info	wakelocks_count;
+	counter_info	resume_causes;
+	counter_info	suspend_fail_causes;
+	counter_info	wakeup_sources;
+	bool		kmsg;		/* input is /dev/kmsg records */
+	bool		warmup;		/* parsing the warm up before -t time */
+	bool		window_done;	/* parsed past -u time */
+	bool		kmsg_seq_valid;	/* kmsg_seq has been set */
+	uint64_t	kmsg_usec;	/* timestamp of current record */
+	uint64_t	kmsg_seq;	/* next expected record sequence number */
+	uint64_t	kmsg_lost;	/* records lost to ring buffer overruns */
+} klog_t;
+
+typedef struct {
+	const char	*line;		/* line with markers in it */
+	size_t		len;		/* length of line */
+} klog_hit_t;
+
+typedef struct {
+	pthread_t	thread;		/* thread scanning this chunk */
+	bool		threaded;	/* true if thread needs joining */
+	const char	*start;		/* start of chunk */
+	const char	*end;		/* end of chunk */
+	matches_t	matches;	/* per thread match results */
+	klog_hit_t	*hits;		/* lines with markers, in log order */
+	size_t		nhits;		/* number of hits */
+	size_t		hits_size;	/* allocated size of hits */
+} klog_chunk_t;
+
+typedef struct {
+	char		*data;		/* decompressed text */
+	size_t		len;		/* length of text in block */
+} klog_block_t;
+
+struct klog_queue;
+
+typedef struct {
+	const char	*name;		/* compression format name */
+	const uint8_t	magic[6];	/* magic bytes at start of data */
+	const size_t	magic_len;	/* number of magic bytes */
+	int (*decompress)(const uint8_t *in, const size_t len, struct klog_queue *q);
+} decompressor_t;
+
+typedef struct klog_queue {
+	pthread_mutex_t	lock;		/* protects head, count and done */
+	pthread_cond_t	cond;		/* signalled when a block moves */
+	klog_block_t	blocks[DECOMP_BLOCKS]; /* ring of text blocks */
+	size_t		head;		/* next block to parse */
+	size_t		count;		/* number of blocks ready to parse */
+	bool		done;		/* decompressor has finished */
+	const decompressor_t *decompressor; /* decompressor for input */
+	const uint8_t	*in;		/* compressed input */
+	size_t		in_len;		/* length of compressed input */
+	const char	*error;		/* decompression error, NULL if none */
+} klog_queue_t;
+
+typedef struct {
+	const char	*filename;	/* kernel log to parse */
+	char		*text;		/* buffered text report */
+	size_t		text_len;	/* length of text report */
+	json_object	*result;	/* JSON report */
+	histograms_t	histograms;	/* histograms to add to the totals */
+	bool		open_failed;	/* kernel log could not be opened */
+	bool		done;		/* job has completed */
+} klog_job_t;
+
+typedef struct {
+	pthread_mutex_t	lock;		/* protects next and job done flags */
+	pthread_cond_t	cond;		/* signalled when a job is done */
+	klog_job_t	*jobs;		/* one job per kernel log */
+	size_t		njobs;		/* number of jobs */
+	size_t		next;		/* next job to be started */
+	bool		json;		/* produce JSON reports */
+	int		opt_freq_min;	/* frequency report period */
+} klog_pool_t;
+
+/*
+ *  Rule actions, what a matching rule does with its marker
+ */
+enum {
+	ACT_NONE,		/* state changes and counting only */
+	ACT_START,		/* suspend started, timestamp of the line */
+	ACT_PM_START,		/* suspend started, PM time stamp argument */
+	ACT_PM_EXIT,		/* PM time stamp argument of suspend exit */
+	ACT_EXIT,		/* suspend exited, timestamp of the line */
+	ACT_FAIL_CAUSE,		/* first cause of a suspend failure */
+	ACT_RESUME_CAUSE,	/* argument is a resume cause */
+	ACT_SUSPENDED_FOR,	/* argument is the suspend duration */
+	ACT_WAKELOCK,		/* argument is the active wakelock */
+	ACT_SUSPEND_DONE,	/* account for a finished suspend attempt */
+	ACT_PHASE_TIME,		/* argument is the latency of phase name */
+	ACT_CALLBACK,		/* a device callback latency, pm_print_times */
+	ACT_MAX
+};
+
+/*
+ *  Counters a rule can bump
+ */
+enum {
+	COUNTER_NONE,
+	COUNTER_WAKELOCKS,
+	COUNTER_RESUME_CAUSES,
+	COUNTER_SUSPEND_FAILURES,
+	COUNTER_WAKEUP_SOURCES,
+	COUNTER_MAX
+};
+
+/*
+ *  Index file header, followed by sections each padded to 8 bytes:
+ *  the kernel log name, the names and cause sets as NUL terminated
+ *  strings in id order, the awake interval and failure event columns,
+ *  the suspend duration event columns and then the counts of each
+ *  counter
+ */
+typedef struct {
+	char		magic[8];	/* INDEX_MAGIC */
+	uint32_t	version;	/* INDEX_VERSION */
+	uint32_t	byte_order;	/* INDEX_BYTE_ORDER */
+	uint64_t	intervals;	/* awake interval and failure events */
+	uint64_t	durations;	/* suspend duration events */
+	uint64_t	kmsg_lost;	/* kmsg records lost */
+	uint32_t	suspend_succeeded; /* number of successful suspends */
+	uint32_t	suspend_failed;	/* number of failed suspends */
+	uint32_t	flags;		/* INDEX_* flags */
+	uint32_t	filename_len;	/* length of kernel log name */
+	uint32_t	names;		/* number of names */
+	uint32_t	names_len;	/* bytes of names */
+	uint32_t	sets;		/* number of cause sets */
+	uint32_t	sets_len;	/* bytes of cause sets */
+	uint32_t	counters[COUNTER_MAX]; /* size of each counter */
+} index_header_t;
+
+/*
+ *  A rule maps a kernel log marker onto the suspend state
+ *  machine. Rules are tried in order on every line that has
+ *  markers in it; the argument is the text offset bytes after
+ *  the start of the marker up to any of the stop characters.
+ */
+typedef struct {
+	const char	*pattern;	/* marker, NULL to fire on state alone */
+	const char	*also;		/* marker that sets also_set too */
+	const char	*stop;		/* characters that end the argument */
+	const char	*name;		/* name to count, NULL counts argument */
+	int		offset;		/* offset of argument from the marker */
+	int		action;		/* ACT_* action */
+	int		need;		/* state bits needed for rule to fire */
+	int		clear;		/* state bits cleared */
+	int		set;		/* state bits set */
+	int		also_set;	/* state bits set if also is found */
+	int		counter;	/* COUNTER_* counter to bump */
+	int		group;		/* only first of a group of rules fires */
+	bool		last;		/* no further rules are tried */
+	char		*pattern_copy;	/* rules file copies of the strings, */
+	char		*also_copy;	/* NULL in built in rules */
+	char		*stop_copy;
+	char		*name_copy;
+	int		id;		/* matcher id of pattern */
+	int		also_id;	/* matcher id of also */
+} rule_t;
+
+typedef struct {
+	const char	*name;
+	int		value;
+} rule_name_t;
+
+/*
+ *  Built in rules for the kernel log dialects of the vendors
+ *  we know about, more can be added with a rules file
+ */
+static const rule_t builtin_rules[] = {
+	{ .pattern = "PM: suspend entry", .offset = 18, .action = ACT_PM_START,
+	  .clear = STATE_ALL, .set = STATE_ENTER_SUSPEND, .last = true },
+	{ .pattern = "PM: suspend exit", .offset = 17, .action = ACT_PM_EXIT },
+	{ .pattern = "suspend: enter suspend", .action = ACT_START,
+	  .clear = STATE_ALL, .set = STATE_ENTER_SUSPEND, .last = true },
+	{ .pattern = "PM: Entering mem sleep", .action = ACT_START,
+	  .clear = STATE_ALL, .set = STATE_ENTER_SUSPEND, .last = true },
+	{ .pattern = "PM: Preparing system for mem sleep", .action = ACT_START,
+	  .clear = STATE_ALL, .set = STATE_ENTER_SUSPEND, .last = true },
+	{ .pattern = "PM: Some devices failed to suspend", .action = ACT_FAIL_CAUSE,
+	  .set = STATE_SUSPEND_FAIL_CAUSE, .counter = COUNTER_SUSPEND_FAILURES,
+	  .name = "device suspend failure", .last = true },
+	{ .pattern = "active wakeup source: ", .offset = 22,
+	  .counter = COUNTER_WAKEUP_SOURCES },
+	/* OMAP */
+	{ .pattern = "Resume caused by", .offset = 17, .action = ACT_RESUME_CAUSE,
+	  .set = STATE_RESUME_CAUSE, .counter = COUNTER_RESUME_CAUSES, .group = 1 },
+	/* MTK */
+	{ .pattern = "[SPM] wake up by", .offset = 17, .stop = " ,",
+	  .action = ACT_RESUME_CAUSE, .set = STATE_RESUME_CAUSE,
+	  .counter = COUNTER_RESUME_CAUSES, .group = 1 },
+	/* In this form, we have a pretty good idea what the suspend duration is */
+	{ .pattern = "Suspended for", .offset = 14, .action = ACT_SUSPENDED_FOR },
+	{ .pattern = "suspend: exit suspend", .action = ACT_EXIT,
+	  .need = STATE_ENTER_SUSPEND, .clear = STATE_ENTER_SUSPEND,
+	  .set = STATE_EXIT_SUSPEND, .group = 2 },
+	{ .pattern = "PM: suspend exit", .action = ACT_EXIT,
+	  .need = STATE_ENTER_SUSPEND, .clear = STATE_ENTER_SUSPEND,
+	  .set = STATE_EXIT_SUSPEND, .group = 2 },
+	{ .action = ACT_SUSPEND_DONE, .need = STATE_EXIT_SUSPEND, .last = true },
+	/* Android */
+	{ .pattern = "active wake lock", .offset = 17, .stop = ",^\n",
+	  .action = ACT_WAKELOCK, .need = STATE_ENTER_SUSPEND,
+	  .set = STATE_ACTIVE_WAKELOCK, .counter = COUNTER_WAKELOCKS, .last = true },
+	{ .pattern = "Disabling non-boot CPUs", .need = STATE_ENTER_SUSPEND,
+	  .set = STATE_SUSPEND_SUCCESS, .last = true },
+	{ .pattern = "Freezing of user space  aborted", .set = STATE_FREEZE_ABORTED,
+	  .counter = COUNTER_SUSPEND_FAILURES, .name = "user space freezer abort",
+	  .group = 3, .last = true },
+	{ .pattern = "Freezing of user space aborted", .set = STATE_FREEZE_ABORTED,
+	  .counter = COUNTER_SUSPEND_FAILURES, .name = "user space freezer abort",
+	  .group = 3, .last = true },
+	{ .pattern = "Freezing of tasks  aborted", .set = STATE_FREEZE_ABORTED,
+	  .also = "tasks refusing to freeze", .also_set = STATE_FREEZE_TASKS_REFUSE,
+	  .counter = COUNTER_SUSPEND_FAILURES, .name = "tasks freezer abort",
+	  .group = 4, .last = true },
+	{ .pattern = "Freezing of tasks aborted", .set = STATE_FREEZE_ABORTED,
+	  .also = "tasks refusing to freeze", .also_set = STATE_FREEZE_TASKS_REFUSE,
+	  .counter = COUNTER_SUSPEND_FAILURES, .name = "tasks freezer abort",
+	  .group = 4, .last = true },
+	/* See power_suspend_late, has_wake_lock() true, so return -EAGAIN */
+	{ .pattern = "power_suspend_late return -11", .set = STATE_LATE_HAS_WAKELOCK,
+	  .counter = COUNTER_SUSPEND_FAILURES, .name = "late suspend wakelock",
+	  .last = true },
+	/* Phase latencies, the freezer may log its elapsed time on a later line */
+	{ .pattern = "Freezing user space processes", .clear = STATE_FREEZING_TASKS,
+	  .set = STATE_FREEZING_USER },
+	{ .pattern = "Freezing remaining freezable tasks", .clear = STATE_FREEZING_USER,
+	  .set = STATE_FREEZING_TASKS },
+	{ .pattern = "(elapsed ", .offset = 9, .action = ACT_PHASE_TIME,
+	  .name = "freeze-user", .need = STATE_FREEZING_USER,
+	  .clear = STATE_FREEZING_USER, .group = 5 },
+	{ .pattern = "(elapsed ", .offset = 9, .action = ACT_PHASE_TIME,
+	  .name = "freeze-tasks", .need = STATE_FREEZING_TASKS,
+	  .clear = STATE_FREEZING_TASKS, .group = 5 },
+	{ .pattern = "PM: suspend of devices complete after", .offset = 38,
+	  .action = ACT_PHASE_TIME, .name = "suspend" },
+	{ .pattern = "PM: late suspend of devices complete after", .offset = 43,
+	  .action = ACT_PHASE_TIME, .name = "suspend-late" },
+	{ .pattern = "PM: noirq suspend of devices complete after", .offset = 44,
+	  .action = ACT_PHASE_TIME, .name = "suspend-noirq" },
+	{ .pattern = "PM: noirq resume of devices complete after", .offset = 43,
+	  .action = ACT_PHASE_TIME, .name = "resume-noirq" },
+	{ .pattern = "PM: early resume of devices complete after", .offset = 43,
+	  .action = ACT_PHASE_TIME, .name = "resume-early" },
+	{ .pattern = "PM: resume of devices complete after", .offset = 37,
+	  .action = ACT_PHASE_TIME, .name = "resume" },
+	/* Newer kernels */
+	{ .pattern = "PM: suspend devices took", .offset = 25,
+	  .action = ACT_PHASE_TIME, .name = "suspend" },
+	{ .pattern = "PM: late suspend devices took", .offset = 30,
+	  .action = ACT_PHASE_TIME, .name = "suspend-late" },
+	{ .pattern = "PM: noirq suspend devices took", .offset = 31,
+	  .action = ACT_PHASE_TIME, .name = "suspend-noirq" },
+	{ .pattern = "PM: noirq resume devices took", .offset = 30,
+	  .action = ACT_PHASE_TIME, .name = "resume-noirq" },
+	{ .pattern = "PM: early resume devices took", .offset = 30,
+	  .action = ACT_PHASE_TIME, .name = "resume-early" },
+	{ .pattern = "PM: resume devices took", .offset = 24,
+	  .action = ACT_PHASE_TIME, .name = "resume" },
+	/* Device callbacks, "call 1-1+ returned 0 after 1234 usecs" */
+	{ .pattern = " returned ", .offset = 10, .action = ACT_CALLBACK },
+};
+
+static const phase_name_t phase_names[PHASE_MAX] = {
+	[PHASE_FREEZE_USER]	= { "freeze-user",	"Freeze user space" },
+	[PHASE_FREEZE_TASKS]	= { "freeze-tasks",	"Freeze tasks" },
+	[PHASE_SUSPEND]		= { "suspend",		"Suspend devices" },
+	[PHASE_SUSPEND_LATE]	= { "suspend-late",	"Late suspend" },
+	[PHASE_SUSPEND_NOIRQ]	= { "suspend-noirq",	"Noirq suspend" },
+	[PHASE_RESUME_NOIRQ]	= { "resume-noirq",	"Noirq resume" },
+	[PHASE_RESUME_EARLY]	= { "resume-early",	"Early resume" },
+	[PHASE_RESUME]		= { "resume",		"Resume devices" },
+};
+
+static const rule_name_t rule_actions[] = {
+	{ "none",		ACT_NONE },
+	{ "start",		ACT_START },
+	{ "pm-start",		ACT_PM_START },
+	{ "pm-exit",		ACT_PM_EXIT },
+	{ "exit",		ACT_EXIT },
+	{ "fail-cause",		ACT_FAIL_CAUSE },
+	{ "resume-cause",	ACT_RESUME_CAUSE },
+	{ "suspended-for",	ACT_SUSPENDED_FOR },
+	{ "wakelock",		ACT_WAKELOCK },
+	{ "phase-time",		ACT_PHASE_TIME },
+	{ "callback",		ACT_CALLBACK },
+	{ NULL,			0 },
+};
+
+static const rule_name_t rule_states[] = {
+	{ "enter",		STATE_ENTER_SUSPEND },
+	{ "exit",		STATE_EXIT_SUSPEND },
+	{ "active-wakelock",	STATE_ACTIVE_WAKELOCK },
+	{ "success",		STATE_SUSPEND_SUCCESS },
+	{ "freeze-aborted",	STATE_FREEZE_ABORTED },
+	{ "late-wakelock",	STATE_LATE_HAS_WAKELOCK },
+	{ "resume-cause",	STATE_RESUME_CAUSE },
+	{ "freeze-tasks-refuse", STATE_FREEZE_TASKS_REFUSE },
+	{ "fail-cause",		STATE_SUSPEND_FAIL_CAUSE },
+	{ "freezing-user",	STATE_FREEZING_USER },
+	{ "freezing-tasks",	STATE_FREEZING_TASKS },
+	{ "all",		STATE_ALL },
+	{ NULL,			0 },
+};
+
+static const rule_name_t rule_counters[] = {
+	{ "none",		COUNTER_NONE },
+	{ "wakelocks",		COUNTER_WAKELOCKS },
+	{ "resume-causes",	COUNTER_RESUME_CAUSES },
+	{ "suspend-failures",	COUNTER_SUSPEND_FAILURES },
+	{ "wakeup-sources",	COUNTER_WAKEUP_SOURCES },
+	{ NULL,			0 },
+};
+
+/* Counters that are only kept when they are going to be reported */
+static const int counter_opts[COUNTER_MAX] = {
+	[COUNTER_WAKELOCKS]	= OPT_WAKELOCK_BLOCKERS,
+	[COUNTER_RESUME_CAUSES]	= OPT_RESUME_CAUSES,
+};
+
+/*
+ *  Built in rules with these actions are only added when one of the
+ *  options needs them, -c tracks the phase of its device callbacks
+ */
+static const int action_opts[ACT_MAX] = {
+	[ACT_PHASE_TIME]	= OPT_PHASES | OPT_CALLBACKS,
+	[ACT_CALLBACK]		= OPT_CALLBACKS,
+};
 
 static int opt_flags;
 static double opt_wakelock_duration;
-static wakelock_info *wakelocks[HASH_SIZE];
+static double opt_wakelock_interval;	/* -I sample interval */
+static const char *opt_wakelock_root = "";	/* -D root of /proc and /sys */
+static const char *opt_wakelock_record;	/* -C snapshot directory */
+static int opt_threads = 1;
+static int opt_histogram_digits = HISTOGRAM_DIGITS;
+static int opt_callbacks;		/* -c number of device callbacks */
+static uint32_t opt_storm_count;	/* -W wakeups that make a storm */
+static double opt_storm_window;		/* -W seconds they happen within */
+static const char *opt_save_index;	/* --save-index file */
+static double opt_since, opt_until;	/* -t and -u times */
+static int opt_since_year, opt_until_year; /* years of -t and -u times */
+static strtab_t wakelock_names;
+static wakelock_info *wakelocks;	/* indexed by wakelock name id */
+static uint32_t wakelocks_size;
+static wakelock_sample wakelock_samples[WAKELOCK_SAMPLES]; /* ring of -I intervals */
+static uint64_t wakelock_nsamples;	/* intervals sampled */
+static struct {
+	int		fd;		/* wakelock file, kept open */
+	bool		proc;		/* /proc/wakelocks rather than /sys */
+	char		*buf;		/* whole file read */
+	size_t		size;		/* buf allocated */
+	size_t		len;		/* length of file read */
+	uint32_t	*rows;		/* wakelock id on each row */
+	uint32_t	nrows;		/* rows known */
+	uint32_t	rows_size;	/* rows allocated */
+} wakelock_file = { .fd = -1 };
+static struct {
+	uint32_t	*ids;		/* wakelock ids sorted by name */
+	uint32_t	n;		/* ids sorted */
+	uint32_t	size;		/* ids allocated */
+} wakelock_order;
+static matcher_t matcher;
+static rule_t *rules;
+static size_t nrules;
 static bool keep_running = true;
+static __thread FILE *fp_output;
 static int print(const char *format, ...) __attribute__((format(printf, 1, 2)));
 
 /*
@@ -196,12 +806,26 @@ static const int signals[] = {
 };
 
 /*
- *  timeval_to_double()
- *	convert timeval to seconds as a double
+ *  clock_seconds()
+ *	time of a clock in seconds as a double
+ */
+static double clock_seconds(const clockid_t clock_id)
+{
+	struct timespec ts;
+
+	if (clock_gettime(clock_id, &ts) < 0)
+		return 0.0;
+	return (double)ts.tv_sec + ((double)ts.tv_nsec / 1000000000.0);
+}
+
+/*
+ *  output()
+ *	stream kernel log reports are written to, stdout unless
+ *	the report is being buffered by a worker thread
  */
-static double timeval_to_double(const struct timeval *tv)
+static inline FILE *output(void)
 {
-	return (double)tv->tv_sec + ((double)tv->tv_usec / 1000000.0);
+	return fp_output ? fp_output : stdout;
 }
 
 /*
@@ -214,7 +838,7 @@ static int print(const char *format, ...)
 	int ret;
 
 	va_start(ap, format);
-	ret = (opt_flags & OPT_QUIET) ? 0 : vprintf(format, ap);
+	ret = (opt_flags & OPT_QUIET) ? 0 : vfprintf(output(), format, ap);
 	va_end(ap);
 
 	return ret;
@@ -225,371 +849,1010 @@ static int print(const char *format, ...)
  *  hash_djb2a()
  *	Hash a string, from Dan Bernstein comp.lang.c (xor version)
  */
-static unsigned long hash_djb2a(const char *str)
+static uint32_t hash_djb2a(const char *str)
 {
-	register unsigned long hash = 5381;
+	register uint32_t hash = 5381;
 	register int c;
 
 	while ((c = *str++)) {
 		/* (hash * 33) ^ c */
-		hash = ((hash << 5) + hash) ^ c;
+		hash = ((hash << 5) + hash) ^ (uint32_t)c;
 	}
-	return hash % HASH_SIZE;
+	return hash;
 }
 
 /*
- *  wakelock_new()
- *	create a new wakelock, nstat denotes start or end wakelock event
- *	collection time
+ *  strtab_rehash()
+ *	double the number of hash slots of a string table, the
+ *	stored hashes mean no string has to be hashed again
  */
-static void wakelock_new(const char *name, wakelock_stats *wakelock, int nstat)
+static void strtab_rehash(strtab_t *st)
 {
-	unsigned long h = hash_djb2a(name);
-	int i;
+	const uint32_t nslots = st->nslots ? st->nslots * 2 : STRTAB_MIN_SLOTS;
+	strtab_slot_t *slots;
+	uint32_t i;
+
+	slots = calloc(nslots, sizeof(*slots));
+	if (!slots) {
+		fprintf(stderr, "Out of memory allocating string table\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < st->nslots; i++) {
+		if (st->slots[i].id) {
+			uint32_t j = st->slots[i].hash & (nslots - 1);
 
-	for (i = 0; i < HASH_SIZE; i++) {
-		if (wakelocks[h] == NULL) {
-			wakelocks[h] = calloc(1, sizeof(*wakelocks[h]));
-			if (!wakelocks[h]) {
-				fprintf(stderr, "Out of memory\n");
-				exit(EXIT_FAILURE);
-			}
-			wakelocks[h]->name = strdup(name);
-			if (!wakelocks[h]->name) {
-				free(wakelocks[h]);
-				fprintf(stderr, "Out of memory\n");
-				exit(EXIT_FAILURE);
-			}
-			memcpy(&wakelocks[h]->stats[nstat], wakelock, sizeof(*wakelock));
-			return;
+			while (slots[j].id)
+				j = (j + 1) & (nslots - 1);
+			slots[j] = st->slots[i];
 		}
-		h = (h + 1) % HASH_SIZE;
 	}
+	free(st->slots);
+	st->slots = slots;
+	st->nslots = nslots;
 }
 
 /*
- *  wakelock_update()
- *	update wakelock stats
+ *  strtab_intern()
+ *	get the id of a string, adding it to the string table if it
+ *	is new. Ids are handed out from 0 in the order strings are
+ *	added, strings are only compared when their hashes match.
  */
-static void wakelock_update(const char *name, wakelock_stats *wakelock, int nstat)
+static uint32_t strtab_intern(strtab_t *st, const char *str)
 {
-	unsigned long h = hash_djb2a(name);
-	int i;
+	const uint32_t hash = hash_djb2a(str);
+	uint32_t i;
 
-	for (i = 0; i < HASH_SIZE; i++) {
-		if (wakelocks[h] &&
-		    !strcmp(name, wakelocks[h]->name)) {
-			memcpy(&wakelocks[h]->stats[nstat], wakelock, sizeof(*wakelock));
-			return;
+	/* Keep the slots no more than 3/4 full */
+	if ((st->count + 1) * 4 > st->nslots * 3)
+		strtab_rehash(st);
+
+	for (i = hash & (st->nslots - 1); st->slots[i].id; i = (i + 1) & (st->nslots - 1)) {
+		if ((st->slots[i].hash == hash) &&
+		    !strcmp(st->strs[st->slots[i].id - 1], str))
+			return st->slots[i].id - 1;
+	}
+
+	if (st->count == st->size) {
+		const uint32_t size = st->size ? st->size * 2 : 16;
+		char **strs = realloc(st->strs, sizeof(*strs) * size);
+
+		if (!strs) {
+			fprintf(stderr, "Out of memory allocating string table\n");
+			exit(EXIT_FAILURE);
 		}
-		h = (h + 1) % HASH_SIZE;
+		st->strs = strs;
+		st->size = size;
 	}
+	if ((st->strs[st->count] = strdup(str)) == NULL) {
+		fprintf(stderr, "Out of memory allocating string table\n");
+		exit(EXIT_FAILURE);
+	}
+	st->slots[i].hash = hash;
+	st->slots[i].id = ++st->count;
 
-	wakelock_new(name, wakelock, nstat);
+	return st->count - 1;
 }
 
 /*
- *  wakelock_free()
- *	free up wakelock hash table
+ *  strtab_str()
+ *	get the string of an id
  */
-static void wakelock_free(void)
+static inline const char *strtab_str(const strtab_t *st, const uint32_t id)
 {
-	int i;
-
-	for (i = 0; i < HASH_SIZE; i++) {
-		if (wakelocks[i]) {
-			free(wakelocks[i]);
-			wakelocks[i] = NULL;
-		}
-	}
+	return st->strs[id];
 }
 
 /*
- *  wakelock_read_sys()
- *	read wakelock status, nstat indicates start or end epoc, from
- *	/sys interface
+ *  strtab_free()
+ *	free a string table
  */
-static int wakelock_read_sys(const int nstat)
+static void strtab_free(strtab_t *st)
 {
-	FILE *fp;
-	char buf[4096];
-	int line;
+	uint32_t i;
 
-	if ((fp = fopen("/sys/kernel/debug/wakeup_sources", "r")) == NULL)
-		return 1;
+	for (i = 0; i < st->count; i++)
+		free(st->strs[i]);
+	free(st->strs);
+	free(st->slots);
+	memset(st, 0, sizeof(*st));
+}
 
-	for (line = 0; fgets(buf, sizeof(buf), fp) != NULL; line++) {
-		wakelock_stats wakelock;
-		char name[WAKELOCK_NAME_SZ];
+/*
+ *  wakelock_id()
+ *	id of a wakelock name, the wakelock table grows to hold it
+ */
+static uint32_t wakelock_id(const char *name)
+{
+	const uint32_t id = strtab_intern(&wakelock_names, name);
 
-		if (!line)
-			continue;	/* skip header */
+	if (id >= wakelocks_size) {
+		const uint32_t size = wakelocks_size ? wakelocks_size * 2 : 64;
+		wakelock_info *new_wakelocks;
 
-		memset(&wakelock, 0, sizeof(wakelock));
-		if (sscanf(buf, "%127s"
-		    " %" SCNu64 " %" SCNu64 " %" SCNu64
-		    " %" SCNu64 " %lg %lg %lg %lg %lg"
-		    ,
-		    name,
-		    &wakelock.active_count,
-		    &wakelock.count,			/* aka event_count */
-		    &wakelock.wakeup_count,
-		    &wakelock.expire_count,
-
-		    &wakelock.active_since,
-		    &wakelock.total_time,
-		    &wakelock.max_time,
-		    &wakelock.last_change,
-		    &wakelock.prevent_time		/* aka prevent_suspend_time */
-		    ) == 10)
-			wakelock_update(name, &wakelock, nstat);
+		new_wakelocks = realloc(wakelocks, sizeof(*wakelocks) * size);
+		if (!new_wakelocks) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(new_wakelocks + wakelocks_size, 0,
+			sizeof(*wakelocks) * (size - wakelocks_size));
+		wakelocks = new_wakelocks;
+		wakelocks_size = size;
 	}
-	(void)fclose(fp);
+	wakelocks[id].name = strtab_str(&wakelock_names, id);
 
-	return 0;
+	return id;
 }
 
 /*
- *  wakelock_read_proc()
- *	read wakelock status, nstat indicates start or end epoc, from
- *	/proc interface
+ *  wakelock_row_id()
+ *	id of the wakelock on a row of the wakelock file, rows are
+ *	matched by position while the list of wakelocks is unchanged
+ *	so the name only has to be hashed when it has changed
  */
-static int wakelock_read_proc(const int nstat)
+static uint32_t wakelock_row_id(const uint32_t row, const char *name)
 {
-	FILE *fp;
-	char buf[4096];
-	int line;
-
-	if ((fp = fopen("/proc/wakelocks", "r")) == NULL)
-		return 1;
+	uint32_t id;
 
-	for (line = 0; fgets(buf, sizeof(buf), fp) != NULL; line++) {
-		wakelock_stats wakelock;
-		char name[WAKELOCK_NAME_SZ];
+	if ((row < wakelock_file.nrows) &&
+	    !strcmp(wakelocks[wakelock_file.rows[row]].name, name))
+		return wakelock_file.rows[row];
 
-		if (!line)
-			continue;	/* skip header */
+	id = wakelock_id(name);
+	if (row >= wakelock_file.rows_size) {
+		const uint32_t size = wakelock_file.rows_size ? wakelock_file.rows_size * 2 : 64;
+		uint32_t *rows;
 
-		memset(&wakelock, 0, sizeof(wakelock));
-		if (sscanf(buf, "\"%127[^\"]\" %" SCNu64 " %" SCNu64 " %" SCNu64
-		    " %lg %lg %lg %lg %lg",
-		    name,
-		    &wakelock.count, &wakelock.expire_count,
-		    &wakelock.wakeup_count, &wakelock.active_since,
-		    &wakelock.total_time, &wakelock.sleep_time,
-		    &wakelock.max_time, &wakelock.last_change) == 9) {
-			wakelock.total_time /= 1000000.0;
-			wakelock.sleep_time /= 1000000.0;
-			wakelock.max_time /= 1000000.0;
-			wakelock.last_change /= 1000000.0;
-			wakelock_update(name, &wakelock, nstat);
+		rows = realloc(wakelock_file.rows, sizeof(*rows) * size);
+		if (!rows) {
+			fprintf(stderr, "Out of memory\n");
+			exit(EXIT_FAILURE);
 		}
+		wakelock_file.rows = rows;
+		wakelock_file.rows_size = size;
 	}
-	(void)fclose(fp);
+	wakelock_file.rows[row] = id;
+	if (row >= wakelock_file.nrows)
+		wakelock_file.nrows = row + 1;
 
-	return 0;
+	return id;
 }
 
 /*
- *  wakelock_read()
- *	read wakelock status, nstat indicates start or end epoc
+ *  wakelock_free()
+ *	free up wakelock table
  */
-static int wakelock_read(const int nstat)
+static void wakelock_free(void)
 {
-	int ret;
+	int i;
 
-	ret = wakelock_read_proc(nstat);
-	if (ret)
-		ret = wakelock_read_sys(nstat);
-	return ret;
+	for (i = 0; i < WAKELOCK_SAMPLES; i++)
+		free(wakelock_samples[i].deltas);
+	memset(wakelock_samples, 0, sizeof(wakelock_samples));
+	wakelock_nsamples = 0;
+	free(wakelocks);
+	wakelocks = NULL;
+	wakelocks_size = 0;
+	strtab_free(&wakelock_names);
+	if (wakelock_file.fd >= 0)
+		(void)close(wakelock_file.fd);
+	free(wakelock_file.buf);
+	free(wakelock_file.rows);
+	memset(&wakelock_file, 0, sizeof(wakelock_file));
+	wakelock_file.fd = -1;
+	free(wakelock_order.ids);
+	memset(&wakelock_order, 0, sizeof(wakelock_order));
 }
 
 /*
- *  wakelock_sort()
- *	qsort comparitor to sort wakelock hack by wakelock name
+ *  wakelock_field_u64()
+ *	parse a space separated unsigned integer field, returns
+ *	NULL if it is not a plain integer
  */
-static int wakelock_sort(const void *p1, const void *p2)
+static inline char *wakelock_field_u64(char *ptr, uint64_t *val)
 {
-	wakelock_info *const *w1 = (wakelock_info *const *)p1;
-	wakelock_info *const *w2 = (wakelock_info *const *)p2;
-
-	if (!*w1 && !*w2)
-		return 0;
-	if (!*w2)
-		return -1;
-	if (!*w1)
-		return 1;
-
-	return strcmp((*w1)->name, (*w2)->name);
+	uint64_t v = 0;
+	int digits = 0;
+
+	while ((*ptr == ' ') || (*ptr == '\t'))
+		ptr++;
+	for (; (*ptr >= '0') && (*ptr <= '9'); ptr++, digits++)
+		v = (v * 10) + (uint64_t)(*ptr - '0');
+	/* More than 19 digits could overflow */
+	if (!digits || (digits > 19) || ((*ptr != ' ') && (*ptr != '\t') && (*ptr != '\0')))
+		return NULL;
+	*val = v;
+
+	return ptr;
 }
 
 /*
- *  json_null
- *	report error if json object is null
+ *  wakelock_field_double()
+ *	parse a space separated unsigned decimal field, returns
+ *	NULL if it is not a plain decimal number
  */
-static void json_null(json_object *obj, char *name)
+static inline char *wakelock_field_double(char *ptr, double *val)
 {
-	if (obj == NULL)
-		fprintf(stderr, "Cannot allocate json %s.\n", name);
+	uint64_t v = 0, frac = 0, scale = 1;
+	int digits = 0;
+
+	while ((*ptr == ' ') || (*ptr == '\t'))
+		ptr++;
+	for (; (*ptr >= '0') && (*ptr <= '9'); ptr++, digits++)
+		v = (v * 10) + (uint64_t)(*ptr - '0');
+	if (*ptr == '.') {
+		for (ptr++; (*ptr >= '0') && (*ptr <= '9'); ptr++, digits++) {
+			if (scale >= 1000000000000000000ULL)
+				return NULL;
+			frac = (frac * 10) + (uint64_t)(*ptr - '0');
+			scale *= 10;
+		}
+	}
+	if (!digits || (digits > 19) || ((*ptr != ' ') && (*ptr != '\t') && (*ptr != '\0')))
+		return NULL;
+	*val = (double)v + ((double)frac / (double)scale);
+
+	return ptr;
 }
 
 /*
- *  json_array()
- *	create new json array
+ *  wakelock_parse_sys()
+ *	parse a row of /sys wakeup_sources, the numbers are parsed by
+ *	hand and anything unusual is left to sscanf
  */
-static json_object *json_array(void)
+static bool wakelock_parse_sys(char *line, char *name, wakelock_stats *wakelock)
 {
-	json_object *obj = json_object_new_array();
+	char *ptr = line;
+	size_t len;
+
+	while ((*ptr == ' ') || (*ptr == '\t'))
+		ptr++;
+	for (len = 0; ptr[len] && (ptr[len] != ' ') && (ptr[len] != '\t'); len++)
+		;
+	if (len && (len < WAKELOCK_NAME_SZ)) {
+		memcpy(name, ptr, len);
+		name[len] = '\0';
+		ptr += len;
+		if ((ptr = wakelock_field_u64(ptr, &wakelock->active_count)) &&
+		    (ptr = wakelock_field_u64(ptr, &wakelock->count)) &&
+		    (ptr = wakelock_field_u64(ptr, &wakelock->wakeup_count)) &&
+		    (ptr = wakelock_field_u64(ptr, &wakelock->expire_count)) &&
+		    (ptr = wakelock_field_double(ptr, &wakelock->active_since)) &&
+		    (ptr = wakelock_field_double(ptr, &wakelock->total_time)) &&
+		    (ptr = wakelock_field_double(ptr, &wakelock->max_time)) &&
+		    (ptr = wakelock_field_double(ptr, &wakelock->last_change)) &&
+		    (ptr = wakelock_field_double(ptr, &wakelock->prevent_time)))
+			return true;
+		memset(wakelock, 0, sizeof(*wakelock));
+	}
 
-	json_null(obj, "array");
-	return obj;
+	return sscanf(line, "%127s"
+		" %" SCNu64 " %" SCNu64 " %" SCNu64
+		" %" SCNu64 " %lg %lg %lg %lg %lg"
+		,
+		name,
+		&wakelock->active_count,
+		&wakelock->count,			/* aka event_count */
+		&wakelock->wakeup_count,
+		&wakelock->expire_count,
+
+		&wakelock->active_since,
+		&wakelock->total_time,
+		&wakelock->max_time,
+		&wakelock->last_change,
+		&wakelock->prevent_time			/* aka prevent_suspend_time */
+		) == 10;
 }
 
 /*
- *  json_int()
- *	create new json object from an integer
+ *  wakelock_parse_proc()
+ *	parse a row of /proc/wakelocks, as for wakelock_parse_sys()
  */
-static json_object *json_int(const int i)
+static bool wakelock_parse_proc(char *line, char *name, wakelock_stats *wakelock)
 {
-	json_object *obj = json_object_new_int(i);
+	char *ptr = line, *quote;
+	size_t len;
+
+	if ((*ptr == '"') && ((quote = strchr(ptr + 1, '"')) != NULL) &&
+	    ((len = (size_t)(quote - ptr - 1)) > 0) && (len < WAKELOCK_NAME_SZ)) {
+		memcpy(name, ptr + 1, len);
+		name[len] = '\0';
+		ptr = quote + 1;
+		if ((ptr = wakelock_field_u64(ptr, &wakelock->count)) &&
+		    (ptr = wakelock_field_u64(ptr, &wakelock->expire_count)) &&
+		    (ptr = wakelock_field_u64(ptr, &wakelock->wakeup_count)) &&
+		    (ptr = wakelock_field_double(ptr, &wakelock->active_since)) &&
+		    (ptr = wakelock_field_double(ptr, &wakelock->total_time)) &&
+		    (ptr = wakelock_field_double(ptr, &wakelock->sleep_time)) &&
+		    (ptr = wakelock_field_double(ptr, &wakelock->max_time)) &&
+		    (ptr = wakelock_field_double(ptr, &wakelock->last_change)))
+			return true;
+		memset(wakelock, 0, sizeof(*wakelock));
+	}
 
-	json_null(obj, "integer");
-	return obj;
+	return sscanf(line, "\"%127[^\"]\" %" SCNu64 " %" SCNu64 " %" SCNu64
+		" %lg %lg %lg %lg %lg",
+		name,
+		&wakelock->count, &wakelock->expire_count,
+		&wakelock->wakeup_count, &wakelock->active_since,
+		&wakelock->total_time, &wakelock->sleep_time,
+		&wakelock->max_time, &wakelock->last_change) == 9;
 }
 
 /*
- *  json_double()
- *	create new json object from a double
+ *  wakelock_open()
+ *	open /proc/wakelocks or failing that /sys wakeup_sources under
+ *	the -D root, the file is kept open between samples. Returns -1
+ *	if neither can be opened.
  */
-static json_object *json_double(const double d)
+static int wakelock_open(void)
 {
-	json_object *obj = json_object_new_double(d);
+	char path[PATH_MAX];
 
-	json_null(obj, "double");
-	return obj;
+	if (wakelock_file.fd >= 0)
+		return 0;
+
+	wakelock_file.proc = true;
+	(void)snprintf(path, sizeof(path), "%s/proc/wakelocks", opt_wakelock_root);
+	if ((wakelock_file.fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0)
+		return 0;
+	wakelock_file.proc = false;
+	(void)snprintf(path, sizeof(path), "%s/sys/kernel/debug/wakeup_sources", opt_wakelock_root);
+	if ((wakelock_file.fd = open(path, O_RDONLY | O_CLOEXEC)) >= 0)
+		return 0;
+	return -1;
 }
 
 /*
- *  json_str()
- *	create new json object from a C string
+ *  wakelock_pread()
+ *	read the whole of a wakelock file from the start into the
+ *	reusable buffer, returns -1 on a read error
  */
-static json_object *json_str(const char *str)
+static int wakelock_pread(const int fd)
 {
-	json_object *obj = json_object_new_string(str);
+	size_t len = 0;
 
-	json_null(obj, "string");
-	return obj;
+	for (;;) {
+		ssize_t n;
+
+		if (len + 1 >= wakelock_file.size) {
+			const size_t size = wakelock_file.size ? wakelock_file.size * 2 : 64 * 1024;
+			char *buf;
+
+			buf = realloc(wakelock_file.buf, size);
+			if (!buf) {
+				fprintf(stderr, "Out of memory allocating wakelock buffer\n");
+				exit(EXIT_FAILURE);
+			}
+			wakelock_file.buf = buf;
+			wakelock_file.size = size;
+		}
+		n = pread(fd, wakelock_file.buf + len,
+			wakelock_file.size - len - 1, (off_t)len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -1;
+		}
+		if (n == 0)
+			break;
+		len += (size_t)n;
+	}
+	wakelock_file.buf[len] = '\0';
+	wakelock_file.len = len;
+
+	return 0;
 }
 
 /*
- *  json_obj()
- *	create new json
+ *  wakelock_record()
+ *	write the wakelock file just read to the -C directory, the
+ *	snapshot is named by the boot and monotonic times it was taken
+ *	so a replay can tell the time awake from the time suspended
  */
-static json_object *json_obj(void)
+static void wakelock_record(void)
 {
-	json_object *obj = json_object_new_object();
-
-	json_null(obj, "object");
-	return obj;
+	char path[PATH_MAX];
+	const char *ptr = wakelock_file.buf;
+	size_t len = wakelock_file.len;
+	int fd;
+
+	(void)snprintf(path, sizeof(path), "%s/%020.9f-%020.9f.%s",
+		opt_wakelock_record,
+		clock_seconds(CLOCK_BOOTTIME), clock_seconds(CLOCK_MONOTONIC),
+		wakelock_file.proc ? "proc" : "sys");
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) < 0) {
+		fprintf(stderr, "Cannot create %s: errno=%d (%s)\n",
+			path, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	while (len) {
+		const ssize_t n = write(fd, ptr, len);
+
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			fprintf(stderr, "Cannot write %s: errno=%d (%s)\n",
+				path, errno, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		ptr += n;
+		len -= (size_t)n;
+	}
+	(void)close(fd);
 }
 
 /*
- *  wakelock_check()
- *	check wakelock activity
+ *  wakelock_parse()
+ *	parse the wakelock file in the buffer, nstat indicates start
+ *	or end epoc
  */
-static void wakelock_check(double request_duration, double duration, json_object *json_results)
+static void wakelock_parse(const int nstat)
 {
-	int i;
-	json_object *results, *obj, *array = NULL, *wl_item;
-
-	if (json_results) {
-		if ((results = json_obj()) == NULL)
-			goto out;
-		json_object_object_add(json_results, "wakelock-data", results);
-
-		if ((obj = json_double(duration)) == NULL)
-			goto out;
-		json_object_object_add(results, "duration-seconds", obj);
-	}
+	char *line, *eol;
+	uint32_t row = 0;
 
-	qsort(wakelocks, HASH_SIZE, sizeof(wakelock_info *), wakelock_sort);
-	/* since we're sorted, if entry 0 is empty then we have no wakelocks */
-	if (!wakelocks[0]) {
-		print("No wakelock data.\n");
+	/* Skip the header */
+	if ((line = strchr(wakelock_file.buf, '\n')) == NULL)
 		return;
-	}
 
-	if (json_results) {
-		if ((array = json_array()) == NULL)
-			goto out;
-		json_object_object_add(results, "wakelocks", array);
-	}
+	for (line++; *line; line = eol + 1) {
+		wakelock_stats wakelock;
+		char name[WAKELOCK_NAME_SZ];
+		bool parsed;
 
-	print("%-32s %-8s %-8s %-8s %-8s %-8s %-8s %-8s\n",
-		"Wakelock", "Active", "Count", "Expire", "Wakeup", "Total", "Sleep", "Prevent");
-	print("%-32s %-8s %-8s %-8s %-8s %-8s %-8s %-8s\n",
-		"Name", "count", "", "count", "count", "time %", "time %", "time %");
-	for (i = 0; i < HASH_SIZE; i++) {
-		if (wakelocks[i]) {
-			double	d_count = WL_DELTA(i, count),
-				d_active_count = WL_DELTA(i, active_count),
-				d_expire_count = WL_DELTA(i, expire_count),
-				d_wakeup_count = WL_DELTA(i, wakeup_count),
-				d_total_time = (100.0 * WL_DELTA(i, total_time) / MS) / duration,
-				d_sleep_time = (100.0 * WL_DELTA(i, sleep_time) / MS) / duration,
-				d_prevent_time = (100.0 * WL_DELTA(i, prevent_time) / MS) / duration;
-
-			d_total_time = NO_NEG(d_total_time);
-			d_sleep_time = NO_NEG(d_sleep_time);
-			d_prevent_time = NO_NEG(d_prevent_time);
-
-			/* dump out stats if non-zero */
-			if (d_active_count + d_count + d_expire_count + d_wakeup_count + d_total_time + d_sleep_time + d_prevent_time > 0.0) {
-				print("%-32.32s %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n",
-					wakelocks[i]->name,
-					d_active_count,
-					d_count, d_expire_count, d_wakeup_count,
-					d_total_time, d_sleep_time, d_prevent_time);
-
-				if (json_results) {
-					if ((wl_item = json_obj()) == NULL)
-						goto out;
-					json_object_array_add(array, wl_item);
-					if ((obj = json_str(wakelocks[i]->name)) == NULL)
-						goto out;
-					json_object_object_add(wl_item, "wakelock", obj);
-					if ((obj = json_double(d_active_count / duration)) == NULL)
-						goto out;
-					json_object_object_add(wl_item, "active_count_per_second", obj);
-					if ((obj = json_double(d_count / duration)) == NULL)
-						goto out;
-					json_object_object_add(wl_item, "count_per_second", obj);
-					if ((obj = json_double(d_expire_count / duration)) == NULL)
-						goto out;
-					json_object_object_add(wl_item, "expire_count_per_second", obj);
-					if ((obj = json_double(d_wakeup_count / duration)) == NULL)
-						goto out;
-					json_object_object_add(wl_item, "wakeup_count_per_second", obj);
-					if ((obj = json_double(d_total_time)) == NULL)
-						goto out;
-					json_object_object_add(wl_item, "total_time_percent", obj);
-					if ((obj = json_double(d_sleep_time)) == NULL)
-						goto out;
-					json_object_object_add(wl_item, "sleep_time_percent", obj);
-					if ((obj = json_double(d_prevent_time)) == NULL)
-						goto out;
-					json_object_object_add(wl_item, "prevent_time_percent", obj);
-				}
+		if ((eol = strchr(line, '\n')) != NULL)
+			*eol = '\0';
+
+		memset(&wakelock, 0, sizeof(wakelock));
+		if (wakelock_file.proc) {
+			parsed = wakelock_parse_proc(line, name, &wakelock);
+			if (parsed) {
+				wakelock.total_time /= 1000000.0;
+				wakelock.sleep_time /= 1000000.0;
+				wakelock.max_time /= 1000000.0;
+				wakelock.last_change /= 1000000.0;
 			}
+		} else {
+			parsed = wakelock_parse_sys(line, name, &wakelock);
+		}
+		if (parsed) {
+			const uint32_t id = wakelock_row_id(row++, name);
+
+			wakelocks[id].stats[nstat] = wakelock;
 		}
+		if (!eol)
+			break;
 	}
-	printf("Requested test duration: %.2f seconds, actual duration: %.2f seconds\n",
-		request_duration, duration);
-out:
-	return;
 }
 
-
+/*
+ *  wakelock_read()
+ *	read wakelock status, nstat indicates start or end epoc
+ */
+static int wakelock_read(const int nstat)
+{
+	if ((wakelock_open() < 0) || (wakelock_pread(wakelock_file.fd) < 0))
+		return 1;
+	if (opt_wakelock_record)
+		wakelock_record();
+	wakelock_parse(nstat);
+
+	return 0;
+}
+
+/*
+ *  wakelock_sort()
+ *	qsort comparitor to sort wakelock ids by wakelock name
+ */
+static int wakelock_sort(const void *p1, const void *p2)
+{
+	const uint32_t *id1 = (const uint32_t *)p1;
+	const uint32_t *id2 = (const uint32_t *)p2;
+
+	return strcmp(wakelocks[*id1].name, wakelocks[*id2].name);
+}
+
+/*
+ *  wakelock_sorted()
+ *	ids of all the wakelocks sorted by name. Wakelocks are never
+ *	removed so the order is kept between reports and only the
+ *	wakelocks seen since the last report are sorted and merged in.
+ */
+static const uint32_t *wakelock_sorted(void)
+{
+	const uint32_t n = wakelock_names.count, m = wakelock_order.n;
+	uint32_t *tail, i, j, k;
+
+	if (m == n)
+		return wakelock_order.ids;
+
+	/* The new ids are sorted in the space after the first n */
+	if (2 * n > wakelock_order.size) {
+		uint32_t *ids;
+
+		ids = realloc(wakelock_order.ids, sizeof(*ids) * n * 2);
+		if (!ids) {
+			fprintf(stderr, "Out of memory allocating sorted wakelocks\n");
+			exit(EXIT_FAILURE);
+		}
+		wakelock_order.ids = ids;
+		wakelock_order.size = n * 2;
+	}
+
+	tail = wakelock_order.ids + n;
+	for (i = m; i < n; i++)
+		tail[i - m] = i;
+	qsort(tail, n - m, sizeof(*tail), wakelock_sort);
+
+	/* and merge them in from the end */
+	for (i = m, j = n - m, k = n; j; ) {
+		if (i && (wakelock_sort(&wakelock_order.ids[i - 1], &tail[j - 1]) > 0))
+			wakelock_order.ids[--k] = wakelock_order.ids[--i];
+		else
+			wakelock_order.ids[--k] = tail[--j];
+	}
+	wakelock_order.n = n;
+
+	return wakelock_order.ids;
+}
+
+/*
+ *  wakelock_counter_delta()
+ *	change in a counter between samples, a counter that went
+ *	backwards was reset so all of it is new
+ */
+static inline uint64_t wakelock_counter_delta(const uint64_t now, const uint64_t last)
+{
+	return now >= last ? now - last : now;
+}
+
+/*
+ *  wakelock_time_delta()
+ *	change in a time between samples, as for counters
+ */
+static inline double wakelock_time_delta(const double now, const double last)
+{
+	return now >= last ? now - last : now;
+}
+
+/*
+ *  wakelock_sample_start()
+ *	start sampling from the wakelock start stats
+ */
+static void wakelock_sample_start(void)
+{
+	uint32_t i;
+
+	for (i = 0; i < wakelock_names.count; i++)
+		wakelocks[i].last = wakelocks[i].stats[WAKELOCK_START];
+
+	print("%s,%s,%s,%s,%s,%s,%s,%s\n", "Start", "End", "Awake", "Wakelock",
+		"Count", "Wakeup count", "Total time", "Prevent time");
+}
+
+/*
+ *  wakelock_sample_take()
+ *	add the wakelocks that changed during a -I interval, which have
+ *	just been read, to the sample ring in name order, a CSV row is
+ *	printed for each of them
+ */
+static void wakelock_sample_take(const double start, const double end, const double awake)
+{
+	wakelock_sample *sample = &wakelock_samples[wakelock_nsamples++ % WAKELOCK_SAMPLES];
+	const uint32_t *sorted = wakelock_sorted();
+	uint32_t i;
+
+	sample->start = start;
+	sample->end = end;
+	sample->awake = awake;
+	sample->n = 0;
+
+	for (i = 0; i < wakelock_names.count; i++) {
+		wakelock_info *wl = &wakelocks[sorted[i]];
+		const wakelock_stats *now = &wl->stats[WAKELOCK_END];
+		wakelock_delta delta;
+
+		delta.id = sorted[i];
+		delta.count = wakelock_counter_delta(now->count, wl->last.count);
+		delta.wakeup_count = wakelock_counter_delta(now->wakeup_count, wl->last.wakeup_count);
+		delta.total_time = wakelock_time_delta(now->total_time, wl->last.total_time);
+		delta.prevent_time = wakelock_time_delta(now->prevent_time, wl->last.prevent_time);
+		wl->last = *now;
+
+		if (!delta.count && !delta.wakeup_count &&
+		    (delta.total_time <= 0.0) && (delta.prevent_time <= 0.0))
+			continue;
+
+		if (sample->n >= sample->size) {
+			const uint32_t size = sample->size ? sample->size * 2 : 16;
+			wakelock_delta *deltas;
+
+			deltas = realloc(sample->deltas, sizeof(*deltas) * size);
+			if (!deltas) {
+				fprintf(stderr, "Out of memory allocating wakelock samples\n");
+				exit(EXIT_FAILURE);
+			}
+			sample->deltas = deltas;
+			sample->size = size;
+		}
+		sample->deltas[sample->n++] = delta;
+
+		print("%.3f,%.3f,%.3f,\"%s\",%" PRIu64 ",%" PRIu64 ",%.6f,%.6f\n",
+			start, end, awake, wl->name, delta.count, delta.wakeup_count,
+			delta.total_time / MS, delta.prevent_time / MS);
+	}
+	(void)fflush(output());
+}
+
+/*
+ *  json_null
+ *	report error if json object is null
+ */
+static void json_null(json_object *obj, char *name)
+{
+	if (obj == NULL)
+		fprintf(stderr, "Cannot allocate json %s.\n", name);
+}
+
+/*
+ *  json_array()
+ *	create new json array
+ */
+static json_object *json_array(void)
+{
+	json_object *obj = json_object_new_array();
+
+	json_null(obj, "array");
+	return obj;
+}
+
+/*
+ *  json_int()
+ *	create new json object from an integer
+ */
+static json_object *json_int(const int i)
+{
+	json_object *obj = json_object_new_int(i);
+
+	json_null(obj, "integer");
+	return obj;
+}
+
+/*
+ *  json_double()
+ *	create new json object from a double
+ */
+static json_object *json_double(const double d)
+{
+	json_object *obj = json_object_new_double(d);
+
+	json_null(obj, "double");
+	return obj;
+}
+
+/*
+ *  json_str()
+ *	create new json object from a C string
+ */
+static json_object *json_str(const char *str)
+{
+	json_object *obj = json_object_new_string(str);
+
+	json_null(obj, "string");
+	return obj;
+}
+
+/*
+ *  json_obj()
+ *	create new json
+ */
+static json_object *json_obj(void)
+{
+	json_object *obj = json_object_new_object();
+
+	json_null(obj, "object");
+	return obj;
+}
+
+/*
+ *  wakelock_check()
+ *	check wakelock activity, duration includes time suspended
+ *	and awake does not
+ */
+static void wakelock_check(
+	double request_duration,
+	double duration,
+	double awake,
+	json_object *json_results)
+{
+	uint32_t i, n = wakelock_names.count;
+	json_object *results = NULL, *obj, *array = NULL, *wl_item;
+	const uint32_t *sorted;
+
+	if (json_results) {
+		if ((results = json_obj()) == NULL)
+			return;
+		json_object_object_add(json_results, "wakelock-data", results);
+
+		if ((obj = json_double(duration)) == NULL)
+			return;
+		json_object_object_add(results, "duration-seconds", obj);
+		if ((obj = json_double(awake)) == NULL)
+			return;
+		json_object_object_add(results, "awake-seconds", obj);
+		if ((obj = json_double(NO_NEG(duration - awake))) == NULL)
+			return;
+		json_object_object_add(results, "suspended-seconds", obj);
+	}
+
+	if (!n) {
+		print("No wakelock data.\n");
+		return;
+	}
+	sorted = wakelock_sorted();
+
+	if (json_results) {
+		if ((array = json_array()) == NULL)
+			return;
+		json_object_object_add(results, "wakelocks", array);
+	}
+
+	print("%-32s %-8s %-8s %-8s %-8s %-8s %-8s %-8s %-8s %-8s\n",
+		"Wakelock", "Active", "Count", "Expire", "Wakeup", "Total", "Sleep", "Prevent",
+		"Total", "Prevent");
+	print("%-32s %-8s %-8s %-8s %-8s %-8s %-8s %-8s %-8s %-8s\n",
+		"Name", "count", "", "count", "count", "time %", "time %", "time %",
+		"awake %", "awake %");
+	for (i = 0; i < n; i++) {
+		const wakelock_info *wl = &wakelocks[sorted[i]];
+		double	d_count = WL_DELTA(wl, count),
+			d_active_count = WL_DELTA(wl, active_count),
+			d_expire_count = WL_DELTA(wl, expire_count),
+			d_wakeup_count = WL_DELTA(wl, wakeup_count),
+			d_total_time = (100.0 * WL_DELTA(wl, total_time) / MS) / duration,
+			d_sleep_time = (100.0 * WL_DELTA(wl, sleep_time) / MS) / duration,
+			d_prevent_time = (100.0 * WL_DELTA(wl, prevent_time) / MS) / duration,
+			d_total_awake = 0.0,
+			d_prevent_awake = 0.0;
+
+		d_total_time = NO_NEG(d_total_time);
+		d_sleep_time = NO_NEG(d_sleep_time);
+		d_prevent_time = NO_NEG(d_prevent_time);
+		if (awake > 0.0) {
+			d_total_awake = d_total_time * duration / awake;
+			d_prevent_awake = d_prevent_time * duration / awake;
+		}
+
+		/* dump out stats if non-zero */
+		if (d_active_count + d_count + d_expire_count + d_wakeup_count + d_total_time + d_sleep_time + d_prevent_time > 0.0) {
+			print("%-32.32s %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f %8.2f\n",
+				wl->name,
+				d_active_count,
+				d_count, d_expire_count, d_wakeup_count,
+				d_total_time, d_sleep_time, d_prevent_time,
+				d_total_awake, d_prevent_awake);
+
+			if (json_results) {
+				if ((wl_item = json_obj()) == NULL)
+					return;
+				json_object_array_add(array, wl_item);
+				if ((obj = json_str(wl->name)) == NULL)
+					return;
+				json_object_object_add(wl_item, "wakelock", obj);
+				if ((obj = json_double(d_active_count / duration)) == NULL)
+					return;
+				json_object_object_add(wl_item, "active_count_per_second", obj);
+				if ((obj = json_double(d_count / duration)) == NULL)
+					return;
+				json_object_object_add(wl_item, "count_per_second", obj);
+				if ((obj = json_double(d_expire_count / duration)) == NULL)
+					return;
+				json_object_object_add(wl_item, "expire_count_per_second", obj);
+				if ((obj = json_double(d_wakeup_count / duration)) == NULL)
+					return;
+				json_object_object_add(wl_item, "wakeup_count_per_second", obj);
+				if ((obj = json_double(d_total_time)) == NULL)
+					return;
+				json_object_object_add(wl_item, "total_time_percent", obj);
+				if ((obj = json_double(d_sleep_time)) == NULL)
+					return;
+				json_object_object_add(wl_item, "sleep_time_percent", obj);
+				if ((obj = json_double(d_prevent_time)) == NULL)
+					return;
+				json_object_object_add(wl_item, "prevent_time_percent", obj);
+				if ((obj = json_double(d_total_awake)) == NULL)
+					return;
+				json_object_object_add(wl_item, "total_time_awake_percent", obj);
+				if ((obj = json_double(d_prevent_awake)) == NULL)
+					return;
+				json_object_object_add(wl_item, "prevent_time_awake_percent", obj);
+			}
+		}
+	}
+	printf("Requested test duration: %.2f seconds, actual duration: %.2f seconds\n",
+		request_duration, duration);
+	printf("Awake: %.2f seconds, suspended: %.2f seconds\n",
+		awake, NO_NEG(duration - awake));
+}
+
+/*
+ *  wakelock_samples_json()
+ *	add the -I intervals still in the sample ring to the JSON
+ *	results as a time series
+ */
+static void wakelock_samples_json(json_object *json_results)
+{
+	json_object *results, *array, *obj, *sample_obj, *wakelocks_array, *wl_item;
+	const uint64_t dropped = wakelock_nsamples > WAKELOCK_SAMPLES ?
+		wakelock_nsamples - WAKELOCK_SAMPLES : 0;
+	uint64_t i;
+	uint32_t j;
+
+	if ((results = json_obj()) == NULL)
+		return;
+	json_object_object_add(json_results, "wakelock-samples", results);
+	if ((obj = json_double(opt_wakelock_interval)) == NULL)
+		return;
+	json_object_object_add(results, "interval-seconds", obj);
+	if ((obj = json_object_new_int64((int64_t)dropped)) == NULL)
+		return;
+	json_object_object_add(results, "intervals-dropped", obj);
+	if ((array = json_array()) == NULL)
+		return;
+	json_object_object_add(results, "intervals", array);
+
+	for (i = dropped; i < wakelock_nsamples; i++) {
+		const wakelock_sample *sample = &wakelock_samples[i % WAKELOCK_SAMPLES];
+
+		if ((sample_obj = json_obj()) == NULL)
+			return;
+		json_object_array_add(array, sample_obj);
+		if ((obj = json_double(sample->start)) == NULL)
+			return;
+		json_object_object_add(sample_obj, "start-seconds", obj);
+		if ((obj = json_double(sample->end)) == NULL)
+			return;
+		json_object_object_add(sample_obj, "end-seconds", obj);
+		if ((obj = json_double(sample->awake)) == NULL)
+			return;
+		json_object_object_add(sample_obj, "awake-seconds", obj);
+		if ((wakelocks_array = json_array()) == NULL)
+			return;
+		json_object_object_add(sample_obj, "wakelocks", wakelocks_array);
+
+		for (j = 0; j < sample->n; j++) {
+			const wakelock_delta *delta = &sample->deltas[j];
+
+			if ((wl_item = json_obj()) == NULL)
+				return;
+			json_object_array_add(wakelocks_array, wl_item);
+			if ((obj = json_str(wakelocks[delta->id].name)) == NULL)
+				return;
+			json_object_object_add(wl_item, "wakelock", obj);
+			if ((obj = json_object_new_int64((int64_t)delta->count)) == NULL)
+				return;
+			json_object_object_add(wl_item, "count", obj);
+			if ((obj = json_object_new_int64((int64_t)delta->wakeup_count)) == NULL)
+				return;
+			json_object_object_add(wl_item, "wakeup_count", obj);
+			if ((obj = json_double(delta->total_time / MS)) == NULL)
+				return;
+			json_object_object_add(wl_item, "total_time_seconds", obj);
+			if ((obj = json_double(delta->prevent_time / MS)) == NULL)
+				return;
+			json_object_object_add(wl_item, "prevent_time_seconds", obj);
+		}
+	}
+}
+
+/*
+ *  wakelock_replay_filter()
+ *	scandir filter for wakelock snapshots recorded with -C
+ */
+static int wakelock_replay_filter(const struct dirent *d)
+{
+	const size_t len = strlen(d->d_name);
+
+	return ((len > 5) && !strcmp(d->d_name + len - 5, ".proc")) ||
+	       ((len > 4) && !strcmp(d->d_name + len - 4, ".sys"));
+}
+
+/*
+ *  wakelock_replay_load()
+ *	load a recorded wakelock snapshot as if it had just been read,
+ *	returns -1 if it cannot be read
+ */
+static int wakelock_replay_load(
+	const char *dir,
+	const char *name,
+	const int nstat,
+	double *boot,
+	double *mono)
+{
+	char path[PATH_MAX];
+	int fd, ret;
+
+	if (sscanf(name, "%lf-%lf", boot, mono) != 2) {
+		fprintf(stderr, "Cannot get the snapshot times from %s\n", name);
+		return -1;
+	}
+	(void)snprintf(path, sizeof(path), "%s/%s", dir, name);
+	if ((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0) {
+		fprintf(stderr, "Cannot open %s: errno=%d (%s)\n",
+			path, errno, strerror(errno));
+		return -1;
+	}
+	ret = wakelock_pread(fd);
+	(void)close(fd);
+	if (ret < 0) {
+		fprintf(stderr, "Cannot read %s\n", path);
+		return -1;
+	}
+	wakelock_file.proc = (strstr(name, ".proc") != NULL);
+	wakelock_parse(nstat);
+
+	return 0;
+}
+
+/*
+ *  wakelock_replay()
+ *	profile wakelocks from the snapshots recorded in a directory
+ *	with -C, as fast as they can be parsed. The first snapshot is
+ *	the start of the profile and the last the end, -I samples are
+ *	taken from the snapshots in between.
+ */
+static void wakelock_replay(const char *dir, json_object *json_results)
+{
+	struct dirent **names;
+	double boot, mono, boot_start = 0.0, mono_start = 0.0;
+	double duration = 0.0, awake = 0.0;
+	double last_sample = 0.0, last_awake = 0.0, next_sample = opt_wakelock_interval;
+	int i, n;
+
+	if ((n = scandir(dir, &names, wakelock_replay_filter, alphasort)) < 0) {
+		fprintf(stderr, "Cannot scan %s: errno=%d (%s)\n",
+			dir, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if (n < 2) {
+		fprintf(stderr, "%s needs at least two wakelock snapshots to replay\n", dir);
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; i++) {
+		if (wakelock_replay_load(dir, names[i]->d_name,
+		    i ? WAKELOCK_END : WAKELOCK_START, &boot, &mono) < 0)
+			exit(EXIT_FAILURE);
+		if (!i) {
+			boot_start = boot;
+			mono_start = mono;
+			if (opt_flags & OPT_WAKELOCK_SAMPLE)
+				wakelock_sample_start();
+			continue;
+		}
+		duration = boot - boot_start;
+		awake = mono - mono_start;
+		if ((opt_flags & OPT_WAKELOCK_SAMPLE) &&
+		    ((duration >= next_sample) || (i == n - 1))) {
+			wakelock_sample_take(last_sample, duration, awake - last_awake);
+			last_sample = duration;
+			last_awake = awake;
+			while (next_sample <= duration)
+				next_sample += opt_wakelock_interval;
+		}
+	}
+	for (i = 0; i < n; i++)
+		free(names[i]);
+	free(names);
+
+	wakelock_check(duration, duration, awake, json_results);
+	if (json_results && (opt_flags & OPT_WAKELOCK_SAMPLE))
+		wakelock_samples_json(json_results);
+	wakelock_free();
+}
+
+
 /*
  *  timestamp_init()
  *	initialize a timestamp
@@ -605,8 +1868,8 @@ static inline void timestamp_init(timestamp *ts)
 
 static int counter_info_cmp(const void *p1, const void *p2)
 {
-	counter_info const *w1 = (counter_info const *)p1;
-	counter_info const *w2 = (counter_info const *)p2;
+	counter_entry const *w1 = (counter_entry const *)p1;
+	counter_entry const *w2 = (counter_entry const *)p2;
 	int diff = w2->count - w1->count;
 
 	if ((diff == 0) && (w1->count | w2->count))
@@ -617,108 +1880,106 @@ static int counter_info_cmp(const void *p1, const void *p2)
 
 /*
  *  counter_free()
- *	free counter hash table
+ *	free counters
  */
-static void counter_free(counter_info counter[])
+static void counter_free(counter_info *counter)
 {
-	unsigned long i;
-
-	for (i = 0; i < HASH_SIZE; i++) {
-		if (counter[i].name)
-			free(counter[i].name);
-
-		memset(&counter[i], 0, sizeof(counter_info));
-	}
+	free(counter->counts);
+	counter->counts = NULL;
+	counter->size = 0;
 }
 
 /*
  *  counter_increment()
- *	increment a hashed counter
+ *	increment the counter of an interned name
  */
-static void counter_increment(const char *name, counter_info counter[])
+static void counter_increment(const char *name, counter_info *counter)
 {
-	unsigned long i = hash_djb2a(name);
-	unsigned long j = 0;
+	const uint32_t id = strtab_intern(counter->names, name);
 
-	for (j = 0; j < HASH_SIZE; j++) {
-		if (counter[i].name == NULL) {
-			counter[i].name = strdup(name);
-			if (counter[i].name == NULL) {
-				fprintf(stderr, "Out of memory!\n");
-				exit(EXIT_FAILURE);
-			}
-			counter[i].count++;
-			return;
-		}
-		if (strcmp(counter[i].name, name) == 0) {
-			counter[i].count++;
-			return;
+	if (id >= counter->size) {
+		uint32_t size = counter->size ? counter->size * 2 : 16;
+		int *counts;
+
+		while (size <= id)
+			size *= 2;
+		counts = realloc(counter->counts, sizeof(*counts) * size);
+		if (!counts) {
+			fprintf(stderr, "Out of memory!\n");
+			exit(EXIT_FAILURE);
 		}
-		i = (i + 1) % HASH_SIZE;
+		memset(counts + counter->size, 0, sizeof(*counts) * (size - counter->size));
+		counter->counts = counts;
+		counter->size = size;
 	}
-
-	fprintf(stderr, "Hash table full!\n");
-	exit(EXIT_FAILURE);
+	counter->counts[id]++;
 }
 
 /*
  *  counter_dump()
  *	output counters
  */
-static void counter_dump(counter_info counter[], const char *label, json_object *json_results)
+static void counter_dump(const counter_info *counter, const char *label, json_object *json_results)
 {
-	int i;
+	uint32_t id;
+	int i, n = 0;
 	int total = 0;
-	bool none = true;
+	counter_entry *sorted;
 
-	for (i = 0; i < HASH_SIZE; i++)
-		if (counter[i].name)
-			total += counter[i].count;
+	sorted = calloc(counter->size ? counter->size : 1, sizeof(*sorted));
+	if (!sorted) {
+		fprintf(stderr, "Out of memory allocating sorted counters\n");
+		exit(EXIT_FAILURE);
+	}
+	for (id = 0; id < counter->size; id++) {
+		if (counter->counts[id]) {
+			total += counter->counts[id];
+			sorted[n].name = strtab_str(counter->names, id);
+			sorted[n++].count = counter->counts[id];
+		}
+	}
 
-	qsort(counter, HASH_SIZE, sizeof(counter_info), counter_info_cmp);
+	qsort(sorted, n, sizeof(*sorted), counter_info_cmp);
 
-	for (i = 0; i < HASH_SIZE; i++) {
-		if (counter[i].name) {
-			print("  %-28.28s %8d  %5.2f%%\n", counter[i].name, counter[i].count,
-				100.0 * (double)counter[i].count / (double)total);
-			none = false;
-		}
+	for (i = 0; i < n; i++) {
+		print("  %-28.28s %8d  %5.2f%%\n", sorted[i].name, sorted[i].count,
+			100.0 * (double)sorted[i].count / (double)total);
 	}
-	if (none)
-		printf("  None\n");
+	if (!n)
+		fprintf(output(), "  None\n");
 	print("\n");
 
 	if (json_results) {
 		json_object *array;
 
 		if ((array = json_array()) == NULL)
-			return;
+			goto out;
 
-		for (i = 0; i < HASH_SIZE; i++) {
-			if (counter[i].name) {
-				json_object *result, *obj;
+		for (i = 0; i < n; i++) {
+			json_object *result, *obj;
 
-				if ((result = json_obj()) == NULL) {
-					break;
-				}
-				json_object_array_add(array, result);
+			if ((result = json_obj()) == NULL) {
+				break;
+			}
+			json_object_array_add(array, result);
 
-				if ((obj = json_str(counter[i].name)) == NULL)
-					break;
-				json_object_object_add(result, "name", obj);
+			if ((obj = json_str(sorted[i].name)) == NULL)
+				break;
+			json_object_object_add(result, "name", obj);
 
-				if ((obj = json_int(counter[i].count)) == NULL)
-					break;
-				json_object_object_add(result, "count", obj);
+			if ((obj = json_int(sorted[i].count)) == NULL)
+				break;
+			json_object_object_add(result, "count", obj);
 
-				if ((obj = json_double((double)counter[i].count / (double)total)) == NULL)
-					break;
-				json_object_object_add(result, "percent", obj);
-			}
+			if ((obj = json_double((double)sorted[i].count / (double)total)) == NULL)
+				break;
+			json_object_object_add(result, "percent", obj);
 		}
 
 		json_object_object_add(json_results, label, array);
 	}
+out:
+	free(sorted);
 }
 
 static int double_cmp(const void *v1, const void *v2)
@@ -740,7 +2001,7 @@ static int double_cmp(const void *v1, const void *v2)
  *
  */
 static int time_calc_stats(
-	time_delta_info *info,
+	const events_t *ev,
 	double *mode,
 	double *median,
 	double *mean,
@@ -748,7 +2009,7 @@ static int time_calc_stats(
 	double *max,
 	double *sum)
 {
-	time_delta_info *tdi;
+	size_t j;
 	int total;
 	double *deltas;
 	int i;
@@ -761,19 +2022,22 @@ static int time_calc_stats(
 	*max = 0.0;
 	*sum = 0.0;
 
-	for (total = 0, tdi = info; tdi; tdi = tdi->next) {
-		if (tdi->type == SUSPEND_FAIL)
+	/* Newest first, so the sums add up in the same order as they always have */
+	for (total = 0, j = ev->n; j-- > 0; ) {
+		const double d = ev->delta[j];
+
+		if (ev->type[j] == SUSPEND_FAIL)
 			continue;
 		if (total == 0) {
-			*min = tdi->delta;
-			*max = tdi->delta;
+			*min = d;
+			*max = d;
 		} else {
-			if (*min > tdi->delta)
-				*min = tdi->delta;
-			if (*max < tdi->delta)
-				*max = tdi->delta;
+			if (*min > d)
+				*min = d;
+			if (*max < d)
+				*max = d;
 		}
-		*sum += tdi->delta;
+		*sum += d;
 		total++;
 	}
 
@@ -788,10 +2052,10 @@ static int time_calc_stats(
 		return 1;
 	}
 
-	for (i = 0, tdi = info; tdi; tdi = tdi->next) {
-		if (tdi->type == SUSPEND_FAIL)
+	for (i = 0, j = 0; j < ev->n; j++) {
+		if (ev->type[j] == SUSPEND_FAIL)
 			continue;
-		deltas[i++] = tdi->delta;
+		deltas[i++] = ev->delta[j];
 	}
 
 	qsort(deltas, total, sizeof(double), double_cmp);
@@ -826,49 +2090,354 @@ static int time_calc_stats(
 }
 
 /*
- *  histogram_dump()
- *	dump out a histogram of durations
+ *  sketch_add()
+ *	add a value to a quantile sketch, the value is binned into
+ *	logarithmically spaced bins so that any quantile can be
+ *	estimated to within SKETCH_ALPHA of its true value
  */
-static void histogram_dump(time_delta_info *info, const char *message)
+static void sketch_add(sketch_t *sk, const double v)
 {
-	int histogram[MAX_INTERVALS];
-	double sum[MAX_INTERVALS];
 	int i;
-	double delta_sum = 0.0;
-	int max = -1;
-	int min = MAX_INTERVALS;
-	time_delta_info *tdi = info;
-	int total = 0;
-	int accurate = 0;
 
-	memset(histogram, 0, sizeof(histogram));
-	for (i = 0; i < MAX_INTERVALS; i++)
-		sum[i] = 0.0;
+	if ((sk->count == 0) || (sk->min > v))
+		sk->min = v;
+	if ((sk->count == 0) || (sk->max < v))
+		sk->max = v;
+	sk->sum += v;
+	sk->count++;
 
-	for (tdi = info; tdi; tdi = tdi->next) {
-		if (tdi->type == SUSPEND_FAIL)
-			continue;
-		total++;
-		if (tdi->accurate)
-			accurate++;
+	if (!(v >= SKETCH_MIN)) {
+		sk->low++;
+	} else {
+		const double b = ceil(log(v / SKETCH_MIN) / SKETCH_LOG_GAMMA);
+
+		/* Clamped as a double, huge values would overflow an int */
+		i = (b < SKETCH_BINS) ? (int)b : SKETCH_BINS - 1;
+		sk->bins[i]++;
 	}
 
-	for (tdi = info; tdi; tdi = tdi->next) {
-		double d = tdi->delta;
+	/* Mode to nearest 1/2 second, long values share the last bin */
+	if (!(v > 0.0))
+		i = 0;
+	else if (v >= SKETCH_MODE_BINS / 2)
+		i = SKETCH_MODE_BINS - 1;
+	else
+		i = (int)rint(2.0 * v);
+	sk->mode[i < SKETCH_MODE_BINS ? i : SKETCH_MODE_BINS - 1]++;
+}
 
-		if (tdi->type == SUSPEND_FAIL)
-			continue;
+/*
+ *  sketch_rank()
+ *	estimate the value of the given rank in a sketch, 0 being
+ *	the smallest value, ranks in the low or last bins are the
+ *	smallest or largest value
+ */
+static double sketch_rank(const sketch_t *sk, const uint64_t rank)
+{
+	uint64_t n = sk->low;
+	int i;
 
-		for (i = 0; (i < MAX_INTERVALS - 1) && (d > 0.125); i++) {
-			if (opt_flags & OPT_HISTOGRAM_DECADES)
-				d = d - 10.0;
-			else
-				d = d / 2.0;
+	if (sk->count == 0)
+		return 0.0;
+	if (n > rank)
+		return sk->min;
+
+	for (i = 0; i < SKETCH_BINS; i++) {
+		n += sk->bins[i];
+		if (n > rank) {
+			const double gamma = exp(SKETCH_LOG_GAMMA);
+			double v = SKETCH_MIN * exp(i * SKETCH_LOG_GAMMA) *
+				2.0 / (1.0 + gamma);
+
+			/* The last bin also holds the values too large to bin */
+			if (i == SKETCH_BINS - 1)
+				return sk->max;
+			if (v < sk->min)
+				v = sk->min;
+			if (v > sk->max)
+				v = sk->max;
+			return v;
+		}
+	}
+	return sk->max;
+}
+
+/*
+ *  sketch_quantile()
+ *	estimate quantile q of the values in a sketch, the nearest
+ *	rank so no quantile is below a smaller one
+ */
+static double sketch_quantile(const sketch_t *sk, const double q)
+{
+	const double rank = ceil(q * (double)sk->count);
+
+	return sk->count ?
+		sketch_rank(sk, (rank > 0.0) ? (uint64_t)rank - 1 : 0) : 0.0;
+}
+
+/*
+ *  sketch_stats()
+ *	as time_calc_stats() but from a sketch, the mode is exact up
+ *	to SKETCH_MODE_BINS / 2 seconds, longer values are left out of
+ *	it, and the median an estimate
+ */
+static void sketch_stats(
+	const sketch_t *sk,
+	double *mode,
+	double *median,
+	double *mean,
+	double *min,
+	double *max,
+	double *sum)
+{
+	uint32_t max_count = 0;
+	int i;
+
+	*mode = 0.0;
+	/* Median of an even number of values is the mean of the middle two */
+	if (sk->count % 2 == 1)
+		*median = sketch_rank(sk, sk->count / 2);
+	else
+		*median = (sketch_rank(sk, sk->count / 2) +
+			   sketch_rank(sk, (sk->count / 2) - 1)) / 2.0;
+	*mean = sk->count ? sk->sum / (double)sk->count : 0.0;
+	*min = sk->min;
+	*max = sk->max;
+	*sum = sk->sum;
+
+	/* The last bin holds all the long values, it has no 1/2 second mode */
+	for (i = 0; i < SKETCH_MODE_BINS - 1; i++) {
+		if (sk->mode[i] && (sk->mode[i] >= max_count)) {
+			max_count = sk->mode[i];
+			*mode = i / 2.0;
 		}
+	}
+	if (!max_count)
+		*mode = sk->max;
+}
+
+/*
+ *  histogram_units()
+ *	convert seconds to histogram units, a bucket of units [lo, hi)
+ *	holds the values (lo, hi] in seconds, as the rows always have
+ */
+static uint64_t histogram_units(const double v)
+{
+	const double u = ceil(ldexp(v, HISTOGRAM_UNIT_SHIFT)) - 1.0;
+
+	if (!(u > 0.0))
+		return 0;
+	if (u >= ldexp(1.0, HISTOGRAM_MAX_SHIFT))
+		return (1ULL << HISTOGRAM_MAX_SHIFT) - 1;
+	return (uint64_t)u;
+}
+
+/*
+ *  histogram_index()
+ *	bucket of a value, the exponent picks the power of 2 bucket and
+ *	the top mantissa bits the sub-bucket within it
+ */
+static inline uint32_t histogram_index(const histogram_t *h, const uint64_t u)
+{
+	const int m = h->half_magnitude;
+	const int bucket = 63 - __builtin_clzll(u | ((2ULL << m) - 1)) - m;
+
+	return (uint32_t)(((uint64_t)bucket << m) + (u >> bucket));
+}
+
+/*
+ *  histogram_lowest()
+ *	lowest value in units of a bucket, the bucket is
+ *	1 << histogram_shift() units wide
+ */
+static uint64_t histogram_lowest(const histogram_t *h, const uint32_t i)
+{
+	const int m = h->half_magnitude;
+	const int bucket = (int)(i >> m) - 1;
+
+	if (bucket <= 0)
+		return i;
+	return ((uint64_t)(i & ((1U << m) - 1)) + (1ULL << m)) << bucket;
+}
+
+/*
+ *  histogram_shift()
+ *	log2 of the width in units of a bucket
+ */
+static int histogram_shift(const histogram_t *h, const uint32_t i)
+{
+	const int bucket = (int)(i >> h->half_magnitude) - 1;
+
+	return bucket < 0 ? 0 : bucket;
+}
+
+/*
+ *  histogram_alloc()
+ *	allocate histogram buckets, enough sub-buckets per power of 2 to
+ *	resolve opt_histogram_digits significant digits
+ */
+static void histogram_alloc(histogram_t *h)
+{
+	uint64_t resolution = 2;
+	int i, m = 0;
+
+	for (i = 0; i < opt_histogram_digits; i++)
+		resolution *= 10;
+	while ((2ULL << m) < resolution)
+		m++;
+
+	h->half_magnitude = m;
+	h->size = (uint32_t)(HISTOGRAM_MAX_SHIFT + 1 - m) << m;
+	h->counts = calloc(h->size, sizeof(*h->counts));
+	h->sums = calloc(h->size, sizeof(*h->sums));
+	if (!h->counts || !h->sums) {
+		fprintf(stderr, "Out of memory allocating histogram\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/*
+ *  histogram_add()
+ *	add a duration to a histogram
+ */
+static void histogram_add(histogram_t *h, const double v, const bool accurate)
+{
+	uint32_t i;
+
+	if (!h->counts)
+		histogram_alloc(h);
+
+	i = histogram_index(h, histogram_units(v));
+	h->counts[i]++;
+	h->sums[i] += v;
+	h->total++;
+	h->accurate += accurate;
+}
+
+/*
+ *  histogram_merge()
+ *	add the values of histogram src to histogram dst
+ */
+static void histogram_merge(histogram_t *dst, const histogram_t *src)
+{
+	uint32_t i;
+
+	if (!src->counts)
+		return;
+	if (!dst->counts)
+		histogram_alloc(dst);
+
+	for (i = 0; i < dst->size; i++) {
+		dst->counts[i] += src->counts[i];
+		dst->sums[i] += src->sums[i];
+	}
+	dst->total += src->total;
+	dst->accurate += src->accurate;
+}
+
+/*
+ *  histogram_free()
+ *	free histogram buckets
+ */
+static void histogram_free(histogram_t *h)
+{
+	free(h->counts);
+	free(h->sums);
+	memset(h, 0, sizeof(*h));
+}
+
+/*
+ *  histograms_merge()
+ *	add awake and suspend histograms to totals
+ */
+static void histograms_merge(histograms_t *dst, const histograms_t *src)
+{
+	histogram_merge(&dst->intervals, &src->intervals);
+	histogram_merge(&dst->durations, &src->durations);
+}
+
+/*
+ *  histograms_free()
+ *	free awake and suspend histograms
+ */
+static void histograms_free(histograms_t *h)
+{
+	histogram_free(&h->intervals);
+	histogram_free(&h->durations);
+}
+
+/*
+ *  histogram_row()
+ *	report row of a bucket, rows are powers of 2 from 0.125 seconds
+ *	or with -d multiples of 10 seconds, the power of 2 rows line up
+ *	with bucket boundaries, the rows of 10 seconds are as accurate
+ *	as the histogram precision
+ */
+static int histogram_row(const histogram_t *h, const uint32_t i)
+{
+	const uint64_t lowest = histogram_lowest(h, i);
+	int row;
+
+	if (opt_flags & OPT_HISTOGRAM_DECADES) {
+		const double d = ldexp((double)(lowest + 1), -HISTOGRAM_UNIT_SHIFT);
+
+		row = (d <= 0.125) ? 0 : (int)ceil((d - 0.125) / 10.0);
+	} else {
+		row = (lowest < (1ULL << HISTOGRAM_FIRST_SHIFT)) ? 0 :
+			63 - __builtin_clzll(lowest) - (HISTOGRAM_FIRST_SHIFT - 1);
+	}
+	return row < MAX_INTERVALS ? row : MAX_INTERVALS - 1;
+}
+
+/*
+ *  histogram_dump_precise()
+ *	dump out every bucket of a histogram, -P
+ */
+static void histogram_dump_precise(const histogram_t *h, const double delta_sum)
+{
+	uint32_t i;
+
+	fprintf(output(), "   Interval (seconds)                  Frequency    Cumulative Time (Seconds)\n");
+	for (i = 0; i < h->size; i++) {
+		const uint64_t lowest = histogram_lowest(h, i);
+		const uint64_t highest = lowest + (1ULL << histogram_shift(h, i));
+
+		if (!h->counts[i])
+			continue;
+		print("  %12.6f - %12.6f     %6u  %5.2f%%  %9.2f  %5.2f%%\n",
+			ldexp((double)lowest, -HISTOGRAM_UNIT_SHIFT),
+			ldexp((double)highest, -HISTOGRAM_UNIT_SHIFT),
+			h->counts[i], 100.0 * (double)h->counts[i] / (double)h->total,
+			h->sums[i], 100.0 * h->sums[i] / delta_sum);
+	}
+}
+
+/*
+ *  histogram_dump()
+ *	dump out a histogram of durations
+ */
+static void histogram_dump(const histogram_t *h, const char *message)
+{
+	int histogram[MAX_INTERVALS];
+	double sum[MAX_INTERVALS];
+	int i;
+	double delta_sum = 0.0;
+	int max = -1;
+	int min = MAX_INTERVALS;
+	uint32_t j;
+
+	memset(histogram, 0, sizeof(histogram));
+	for (i = 0; i < MAX_INTERVALS; i++)
+		sum[i] = 0.0;
+
+	for (j = 0; j < h->size; j++) {
+		if (!h->counts[j])
+			continue;
 
-		histogram[i]++;
-		sum[i] += tdi->delta;
-		delta_sum += tdi->delta;
+		i = histogram_row(h, j);
+		histogram[i] += h->counts[j];
+		sum[i] += h->sums[j];
+		delta_sum += h->sums[j];
 		if (i > max)
 			max = i;
 		if (i < min)
@@ -878,6 +2447,8 @@ static void histogram_dump(time_delta_info *info, const char *message)
 	print("%s\n", message);
 	if (max == -1) {
 		print("  No values.\n");
+	} else if (opt_flags & OPT_HISTOGRAM_PRECISION) {
+		histogram_dump_precise(h, delta_sum);
 	} else {
 		double range1 = 0.0, range2;
 
@@ -886,10 +2457,10 @@ static void histogram_dump(time_delta_info *info, const char *message)
 		else
 			range2 = 0.125;
 
-		printf("   Interval (seconds)          Frequency    Cumulative Time (Seconds)\n");
+		fprintf(output(), "   Interval (seconds)          Frequency    Cumulative Time (Seconds)\n");
 		for (range1 = 0.0, i = 0; i < MAX_INTERVALS; i++) {
 			if (i >= min && i <= max) {
-				double pc = 100.0 * (double) histogram[i] / (double)total;
+				double pc = 100.0 * (double) histogram[i] / (double)h->total;
 				if (i == MAX_INTERVALS - 1)
 					print("  %8.3f -              %6d  %5.2f%%  %9.2f  %5.2f%%\n", range1, histogram[i], pc, sum[i], 100.0 * sum[i] / delta_sum);
 				else
@@ -901,116 +2472,433 @@ static void histogram_dump(time_delta_info *info, const char *message)
 			else
 				range2 = range2 + range2;
 		}
-		if (accurate != total) {
-			print("NOTE: %5.2f%% of the samples were inaccurate estimates.\n",
-				100.0 * (double)(total-accurate) / (double)total);
-		}
+	}
+	if ((max != -1) && (h->accurate != h->total)) {
+		print("NOTE: %5.2f%% of the samples were inaccurate estimates.\n",
+			100.0 * (double)(h->total - h->accurate) / (double)h->total);
 	}
 	print("\n");
 }
 
 
+/*
+ *  cause_set_text()
+ *	join the names of a set of causes with '+', an empty set
+ *	is "(null)"; the caller frees the text
+ */
+static char *cause_set_text(const strtab_t *names, const uint32_t *ids, const uint32_t n)
+{
+	size_t len = sizeof("(null)");
+	uint32_t i;
+	char *text, *ptr;
+
+	for (i = 0; i < n; i++)
+		len += strlen(strtab_str(names, ids[i])) + 1;
+	if ((text = malloc(len)) == NULL) {
+		fprintf(stderr, "Out of memory allocating cause text\n");
+		exit(EXIT_FAILURE);
+	}
+	if (!n) {
+		strcpy(text, "(null)");
+		return text;
+	}
+	for (ptr = text, i = 0; i < n; i++) {
+		const char *name = strtab_str(names, ids[i]);
+		const size_t name_len = strlen(name);
+
+		if (i)
+			*ptr++ = '+';
+		memcpy(ptr, name, name_len);
+		ptr += name_len;
+	}
+	*ptr = '\0';
+
+	return text;
+}
+
+/*
+ *  klog_cause_add()
+ *	add a resume cause to the causes of the current suspend, the
+ *	causes are kept sorted by name and each is only added once
+ */
+static void klog_cause_add(klog_t *klog, const char *cause)
+{
+	const uint32_t id = strtab_intern(&klog->names, cause);
+	uint32_t i;
+
+	for (i = 0; i < klog->ncauses; i++) {
+		if (klog->causes[i] == id)
+			return;
+		if (strcmp(strtab_str(&klog->names, klog->causes[i]), cause) > 0)
+			break;
+	}
+	if (klog->ncauses == klog->causes_size) {
+		const uint32_t size = klog->causes_size ? klog->causes_size * 2 : 8;
+		uint32_t *causes = realloc(klog->causes, sizeof(*causes) * size);
+
+		if (!causes) {
+			fprintf(stderr, "Out of memory allocating causes\n");
+			exit(EXIT_FAILURE);
+		}
+		klog->causes = causes;
+		klog->causes_size = size;
+	}
+	memmove(&klog->causes[i + 1], &klog->causes[i],
+		sizeof(*klog->causes) * (klog->ncauses - i));
+	klog->causes[i] = id;
+	klog->ncauses++;
+}
+
+/*
+ *  klog_reason()
+ *	get the reason id of a prefix and a set of cause ids, equal
+ *	sets of causes share the same set id
+ */
+static int klog_reason(klog_t *klog, const int prefix, const uint32_t *ids, const uint32_t n)
+{
+	char buf[256], *key = buf, *ptr;
+	const size_t len = ((size_t)n * 11) + 1;
+	uint32_t i, set;
+
+	if ((len > sizeof(buf)) && ((key = malloc(len)) == NULL)) {
+		fprintf(stderr, "Out of memory allocating cause set\n");
+		exit(EXIT_FAILURE);
+	}
+	for (ptr = key, *ptr = '\0', i = 0; i < n; i++)
+		ptr += sprintf(ptr, i ? "+%" PRIu32 : "%" PRIu32, ids[i]);
+	set = strtab_intern(&klog->sets, key);
+	if (key != buf)
+		free(key);
+
+	return (int)((set << 2) | (uint32_t)prefix);
+}
+
+/*
+ *  klog_reason_text()
+ *	render a reason as "prefix:cause+cause...", the caller
+ *	frees the text
+ */
+static char *klog_reason_text(const klog_t *klog, const int reason)
+{
+	static const char prefixes[] = "RAF";
+	const char *key = strtab_str(&klog->sets, (uint32_t)reason >> 2);
+	uint32_t *ids, n = 0;
+	char *causes, *text;
+	const char *ptr;
+
+	for (ptr = key; *ptr; ptr++)
+		n += (*ptr == '+');
+	n += (*key != '\0');
+	if ((ids = calloc(n ? n : 1, sizeof(*ids))) == NULL) {
+		fprintf(stderr, "Out of memory allocating cause set\n");
+		exit(EXIT_FAILURE);
+	}
+	for (n = 0, ptr = key; *ptr; ) {
+		char *end;
+
+		ids[n++] = (uint32_t)strtoul(ptr, &end, 10);
+		ptr = *end ? end + 1 : end;
+	}
+
+	causes = cause_set_text(&klog->names, ids, n);
+	if ((text = malloc(strlen(causes) + 3)) == NULL) {
+		fprintf(stderr, "Out of memory allocating cause text\n");
+		exit(EXIT_FAILURE);
+	}
+	sprintf(text, "%c:%s", prefixes[reason & 3], causes);
+	free(causes);
+	free(ids);
+
+	return text;
+}
+
 /*
  *  frequency_dump()
  * 	for importing into a spreadsheet
  */
 static void frequency_dump(
-	time_delta_info *suspend_list,
+	const klog_t *klog,
 	const int opt_freq_min)
 {
-	time_delta_info *tdi;
+	const events_t *ev = &klog->suspend_list;
+	const size_t nreasons = (size_t)klog->sets.count << 2;
+	size_t j, cols;
 	double t_start = 1.0e50, t_end = 0.0;
-	int hours, i;
-	freq_info_t *freq;
-	reason_t *reason_list = NULL, *r;
+	int periods, i;
+	size_t *last = NULL;
+	int *column = NULL;
+	unsigned int *matrix = NULL;
 	int reasons = 0;
 	int secs = opt_freq_min * 60;
 
-	for (tdi = suspend_list; tdi; tdi = tdi->next) {
-		if (t_end < tdi->start)
-			t_end = tdi->start;
-		if (t_start > tdi->start)
-			t_start = tdi->start;
-		if (tdi->reason) {
-			bool found = false;
-
-			for (r = reason_list; r; r = r->next) {
-				if (!strcmp(r->reason, tdi->reason)) {
-					found = true;
-					break;
-				}
-			}
-			if (!found) {
-				r = malloc(sizeof(reason_t));
-				if (!r) {
-					fprintf(stderr, "Cannot allocate memory\n");
-					exit(EXIT_FAILURE);
-				}
-				r->reason = tdi->reason;
-				r->next = reason_list;
-				reason_list = r;
-				reasons++;
-			}
-		}
+	/* Reasons are columns in order of their last occurrence */
+	last = malloc((nreasons + 1) * sizeof(*last));
+	column = malloc((nreasons + 1) * sizeof(*column));
+	if (!last || !column) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		exit(EXIT_FAILURE);
+	}
+	for (j = 0; j < ev->n; j++) {
+		if (t_end < ev->start[j])
+			t_end = ev->start[j];
+		if (t_start > ev->start[j])
+			t_start = ev->start[j];
+		if (ev->reason[j] != REASON_NONE)
+			last[ev->reason[j]] = j;
+	}
+	for (j = 0; j < ev->n; j++) {
+		const int32_t reason = ev->reason[j];
+
+		if ((reason != REASON_NONE) && (last[reason] == j))
+			column[reason] = reasons++;
 	}
 
-	hours = (int)(((t_end - t_start) / secs) + 0.9999);
-	if ((reasons < 1) || (hours < 1)) {
-		printf("\nNot enough data for frequency data\n");
+	periods = (int)(((t_end - t_start) / secs) + 0.9999);
+	if ((reasons < 1) || (periods < 1)) {
+		fprintf(output(), "\nNot enough data for frequency data\n");
 		goto free_list;
 	}
-	freq = alloca(sizeof(freq_info_t) * hours);
 
-	memset(freq, 0, sizeof(freq_info_t) * hours);
-	for (i = 0; i < hours; i++)
-		freq[i].reason_counts = calloc(reasons, sizeof(unsigned int));
+	/* periods x (good, failed, reasons) */
+	cols = 2 + (size_t)reasons;
+	matrix = calloc((size_t)periods * cols, sizeof(*matrix));
+	if (!matrix) {
+		fprintf(stderr, "Cannot allocate memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (j = 0; j < ev->n; j++) {
+		int whence = (int)((ev->start[j] - t_start) / secs);
+		unsigned int *row;
+
+		/* The last event can be right at the end of the last period */
+		if (whence >= periods)
+			whence = periods - 1;
+		row = &matrix[(size_t)whence * cols];
+		row[ev->type[j] == SUSPEND_FAIL]++;
+		if (ev->reason[j] != REASON_NONE)
+			row[2 + column[ev->reason[j]]]++;
+	}
 
-	for (tdi = suspend_list; tdi; tdi = tdi->next) {
-		int whence = (int)((tdi->start - t_start) / secs);
-		if (tdi->type == SUSPEND_FAIL)
-			freq[whence].failed_count++;
-		else
-			freq[whence].succeed_count++;
-		if (tdi->reason) {
-			for (i = 0, r = reason_list; r; r = r->next, i++) {
-				if (!strcmp(r->reason, tdi->reason))
-					freq[whence].reason_counts[i]++;
-			}
+	fprintf(output(), "\n%s\t%s\t%s\t%s", "Time", "Hour", "Good", "Failed");
+	for (j = 0; j < ev->n; j++) {
+		const int32_t reason = ev->reason[j];
+
+		if ((reason != REASON_NONE) && (last[reason] == j)) {
+			char *text = klog_reason_text(klog, reason);
+
+			fprintf(output(), "\t%s", text);
+			free(text);
 		}
 	}
+	fprintf(output(), "\n");
 
-	printf("\n%s\t%s\t%s\t%s", "Time", "Hour", "Good", "Failed");
-	for (r = reason_list; r; r = r->next)
-		printf("\t%s", r->reason);
-	printf("\n");
-
-	for (i = 0; i < hours; i++) {
-		int j;
+	for (i = 0; i < periods; i++) {
+		const unsigned int *row = &matrix[(size_t)i * cols];
 		time_t t = (time_t)(t_start + (3600.0 * (double)i));
-		struct tm *tm;
-
-		tm = localtime(&t);
-		printf("%2.2d:%2.2d\t%d\t%u\t%u",
-			tm->tm_hour, tm->tm_min, i,
-			freq[i].succeed_count,
-			freq[i].failed_count);
-		for (j = 0; j < reasons; j++)
-			printf("\t%u", freq[i].reason_counts[j]);
-		printf("\n");
+		struct tm tm;
+
+		(void)localtime_r(&t, &tm);
+		fprintf(output(), "%2.2d:%2.2d\t%d\t%u\t%u",
+			tm.tm_hour, tm.tm_min, i, row[0], row[1]);
+		for (j = 2; j < cols; j++)
+			fprintf(output(), "\t%u", row[j]);
+		fprintf(output(), "\n");
 	}
-	printf("\nPrefixes:\n");
-	printf(" 'A:' - Aborted suspend\n");
-	printf(" 'R:' - Resumed\n");
+	fprintf(output(), "\nPrefixes:\n");
+	fprintf(output(), " 'A:' - Aborted suspend\n");
+	fprintf(output(), " 'R:' - Resumed\n");
 
 free_list:
-	for (r = reason_list; r;) {
-		reason_t *next = r->next;
+	free(matrix);
+	free(column);
+	free(last);
+}
+
+
+/*
+ *  Powers of ten, every one of these is exact as a double
+ */
+static const double pow10_dbl[] = {
+	1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+	1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+	1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+
+static const uint64_t pow10_u64[] = {
+	1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL,
+	10000000ULL, 100000000ULL, 1000000000ULL, 10000000000ULL,
+	100000000000ULL, 1000000000000ULL, 10000000000000ULL,
+	100000000000000ULL, 1000000000000000ULL, 10000000000000000ULL,
+	100000000000000000ULL
+};
+
+/*
+ *  parse_decimal()
+ *	parse a plain unsigned decimal of at most 20 characters as
+ *	m / 10^k with m below 10^15, so that m and 10^k are exact
+ *	doubles and their quotient is the correctly rounded value
+ *	that strtod gives. Returns the end of the number or NULL if
+ *	the number has to be left to sscanf.
+ */
+static const char *parse_decimal(const char *ptr, uint64_t *m, int *k)
+{
+	const char *start = ptr;
+	bool point = false;
+	int digits = 0;
+
+	*m = 0;
+	*k = 0;
+	for (;; ptr++) {
+		if ((*ptr >= '0') && (*ptr <= '9')) {
+			if (++digits > 17)
+				return NULL;
+			*m = (*m * 10) + (uint64_t)(*ptr - '0');
+			*k += point;
+		} else if ((*ptr == '.') && !point) {
+			point = true;
+		} else {
+			break;
+		}
+	}
+	if (!digits || (ptr - start > 20) || (*m >= pow10_u64[15]))
+		return NULL;
+	/* Exponents, hex and inf/nan are left to sscanf */
+	if (isalnum((unsigned char)*ptr) || (*ptr == '.'))
+		return NULL;
+
+	return ptr;
+}
+
+/*
+ *  decimal_text()
+ *	format m / 10^k rounded to places decimal places and padded
+ *	to width with pad, as printf would format the nearest double.
+ *	Returns false for the few values half way between two
+ *	roundings, printf rounds those depending on the double.
+ */
+static bool decimal_text(
+	char *text,
+	uint64_t m,
+	const int k,
+	const int places,
+	const int width,
+	const char pad)
+{
+	char tmp[32], *ptr = tmp + sizeof(tmp) - 1;
+	int i, len;
+
+	if (m >= pow10_u64[15])
+		return false;
+	if (k > places) {
+		const uint64_t div = pow10_u64[k - places];
+		const uint64_t rem = m % div;
+
+		if (rem + rem == div)
+			return false;
+		m = (m / div) + (rem + rem > div);
+	} else {
+		m *= pow10_u64[places - k];
+		if (m >= pow10_u64[15])
+			return false;
+	}
 
-		free(r);
-		r = next;
+	*ptr = '\0';
+	for (i = 0; i < places; i++, m /= 10)
+		*--ptr = (char)('0' + (m % 10));
+	if (places)
+		*--ptr = '.';
+	do {
+		*--ptr = (char)('0' + (m % 10));
+		m /= 10;
+	} while (m);
+
+	len = (int)(tmp + sizeof(tmp) - 1 - ptr);
+	for (i = len; i < width; i++)
+		*text++ = pad;
+	memcpy(text, ptr, (size_t)len + 1);
+
+	return true;
+}
+
+/*
+ *  parse_digits()
+ *	parse exactly n decimal digits
+ */
+static inline const char *parse_digits(const char *ptr, const int n, int *val)
+{
+	int i;
+
+	*val = 0;
+	for (i = 0; i < n; i++, ptr++) {
+		if ((*ptr < '0') || (*ptr > '9'))
+			return NULL;
+		*val = (*val * 10) + (*ptr - '0');
 	}
+	return ptr;
 }
 
+/*
+ *  parse_pm_timestamp_fast()
+ *	parse the usual fixed format of PM time stamps by hand. With
+ *	tm_isdst fixed at 0 the time is linear within a day, so mktime
+ *	is only needed once for each day, the result is cached per
+ *	thread. Returns false if the slow path has to parse it.
+ */
+static bool parse_pm_timestamp_fast(const char *ptr, timestamp *ts)
+{
+	static __thread struct {
+		int	year, mon, mday;	/* day cached */
+		time_t	base;			/* mktime of day at 00:00:00 */
+	} day = { -1, -1, -1, 0 };
+	int year, mon, mday, hour, min, k, isec;
+	uint64_t m;
+	double sec;
+	time_t t;
+
+	if (((ptr = parse_digits(ptr, 4, &year)) == NULL) || (*ptr++ != '-') ||
+	    ((ptr = parse_digits(ptr, 2, &mon)) == NULL) || (*ptr++ != '-') ||
+	    ((ptr = parse_digits(ptr, 2, &mday)) == NULL) || (*ptr++ != ' ') ||
+	    ((ptr = parse_digits(ptr, 2, &hour)) == NULL) || (*ptr++ != ':') ||
+	    ((ptr = parse_digits(ptr, 2, &min)) == NULL) || (*ptr++ != ':') ||
+	    (parse_decimal(ptr, &m, &k) == NULL))
+		return false;
+
+	sec = (double)m / pow10_dbl[k];
+	if (sec >= 61.0)
+		return false;
+	isec = (int)sec;
+
+	if ((year != day.year) || (mon != day.mon) || (mday != day.mday)) {
+		struct tm tm;
+
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = year - 1900;
+		tm.tm_mon = mon - 1;
+		tm.tm_mday = mday;
+		day.base = mktime(&tm);
+		day.year = year;
+		day.mon = mon;
+		day.mday = mday;
+	}
+	if (day.base == (time_t)-1)
+		return false;
+	t = day.base + (hour * 3600) + (min * 60) + isec;
+
+	ts->whence_text[0] = (char)('0' + (hour / 10));
+	ts->whence_text[1] = (char)('0' + (hour % 10));
+	ts->whence_text[2] = ':';
+	ts->whence_text[3] = (char)('0' + (min / 10));
+	ts->whence_text[4] = (char)('0' + (min % 10));
+	ts->whence_text[5] = ':';
+	if (!decimal_text(ts->whence_text + 6, m, k, 5, 8, '0'))
+		sprintf(ts->whence_text + 6, "%08.5f", sec);
+
+	ts->pm_whence = sec - (double)isec + (double)t;
+	ts->pm_whence_valid = true;
+
+	return true;
+}
 
 /*
  *  Parse PM time stamps of the form:
@@ -1022,6 +2910,9 @@ static void parse_pm_timestamp(const char *ptr, timestamp *ts)
 	double sec;
 	int n;
 
+	if (parse_pm_timestamp_fast(ptr, ts))
+		return;
+
 	memset(&tm, 0, sizeof(tm));
 
 	n = sscanf(ptr, "%4d-%2d-%2d %2d:%2d:%20lf",
@@ -1053,16 +2944,31 @@ static void parse_pm_timestamp(const char *ptr, timestamp *ts)
  */
 static void parse_timestamp(const char *line, timestamp *ts)
 {
-	char *ptr1, *ptr2;
+	const char *ptr1, *ptr2;
 
-	ptr1 = strstr(line, "[");
-	ptr2 = strstr(line, "]");
+	ptr1 = strchr(line, '[');
+	ptr2 = strchr(line, ']');
 
 	ts->whence_valid = false;
 	ts->whence = -1.0;
 
 	if (ptr1 && ptr2 && ptr2 > ptr1) {
-		int n = sscanf(ptr1 + 1, "%20lf", &ts->whence);
+		const char *ptr = ptr1 + 1;
+		uint64_t m;
+		int n, k;
+
+		/* The usual plain decimal is converted exactly by hand */
+		while (isspace((unsigned char)*ptr))
+			ptr++;
+		if (parse_decimal(ptr, &m, &k) &&
+		    decimal_text(ts->whence_text, m, k, 6, 12, ' ')) {
+			ts->whence = (double)m / pow10_dbl[k];
+			ts->whence_valid = true;
+			strcat(ts->whence_text, "  ");
+			return;
+		}
+
+		n = sscanf(ptr1 + 1, "%20lf", &ts->whence);
 		if (n == 1) {
 			ts->whence_valid = true;
 			sprintf(ts->whence_text, "%12.6f  ", ts->whence);
@@ -1075,566 +2981,3262 @@ static void parse_timestamp(const char *line, timestamp *ts)
 }
 
 /*
- *  free_time_delta_info_list()
- *	free list
+ *  events_add()
+ *	append an event to the event columns, returns its index
  */
-static void free_time_delta_info_list(time_delta_info *list)
+static size_t events_add(
+	events_t *ev,
+	const int type,
+	const double start,
+	const double delta,
+	const bool accurate,
+	const int reason)
 {
-	while (list) {
-		time_delta_info *next = list->next;
-		if (list->reason)
-			free(list->reason);
-		free(list);
-		list = next;
+	if (ev->n == ev->size) {
+		const size_t size = ev->size ? ev->size * 2 : 256;
+		double *new_start, *new_delta;
+		int32_t *new_reason;
+		uint8_t *new_type, *new_accurate;
+
+		new_start = realloc(ev->start, size * sizeof(*ev->start));
+		if (new_start)
+			ev->start = new_start;
+		new_delta = realloc(ev->delta, size * sizeof(*ev->delta));
+		if (new_delta)
+			ev->delta = new_delta;
+		new_reason = realloc(ev->reason, size * sizeof(*ev->reason));
+		if (new_reason)
+			ev->reason = new_reason;
+		new_type = realloc(ev->type, size * sizeof(*ev->type));
+		if (new_type)
+			ev->type = new_type;
+		new_accurate = realloc(ev->accurate, size * sizeof(*ev->accurate));
+		if (new_accurate)
+			ev->accurate = new_accurate;
+		if (!new_start || !new_delta || !new_reason ||
+		    !new_type || !new_accurate) {
+			fprintf(stderr, "Out of memory allocating events\n");
+			exit(EXIT_FAILURE);
+		}
+		ev->size = size;
 	}
+	ev->start[ev->n] = start;
+	ev->delta[ev->n] = delta;
+	ev->reason[ev->n] = reason;
+	ev->type[ev->n] = (uint8_t)type;
+	ev->accurate[ev->n] = accurate;
+
+	return ev->n++;
 }
 
-static int str_cmp(const void *p1, const void *p2)
+/*
+ *  events_needed()
+ *	with -S the sketches replace the event columns unless a
+ *	report needs every event
+ */
+static inline bool events_needed(void)
 {
-	return strcmp(* (char * const *) p1, * (char * const *) p2);
+	return !(opt_flags & OPT_SKETCH) ||
+		(opt_flags & (OPT_FREQUENCY_REPORT | OPT_SAVE_INDEX));
 }
 
-static char *str_sort_add(char *resume_cause, const char *cause)
+/*
+ *  events_free()
+ *	free event columns
+ */
+static void events_free(events_t *ev)
 {
-	char *str, *token;
-	char **ptrs;
-	size_t n, i;
-
-	/* Don't duplicate */
-	if (resume_cause == NULL) {
-		if ((str = strdup(cause)) == NULL)
-			goto err;
-		return str;
-	}
-	if (strstr(resume_cause, cause))
-		return resume_cause;
+	/* Index columns go when the index is unmapped */
+	if (ev->mapped)
+		return;
+	free(ev->start);
+	free(ev->delta);
+	free(ev->reason);
+	free(ev->type);
+	free(ev->accurate);
+}
 
-	for (n = 2, str = resume_cause; *str; str++)
-		if (*str == '+')
-			n++;
+/*
+ *  matcher_add()
+ *	add a pattern to the matcher, returns the pattern id,
+ *	duplicate patterns share the same id
+ */
+static int matcher_add(matcher_t *m, const char *pattern)
+{
+	uint32_t i;
+	char **patterns;
+	size_t *lengths;
 
-	ptrs = alloca(sizeof(char *) * n);
-	for (i = 0, str = resume_cause; (token = strtok(str, "+")) != NULL; str = NULL) {
-		if ((ptrs[i++] = strdup(token)) == NULL)
-			goto err;
-	}
-	if ((ptrs[i] = strdup(cause)) == NULL)
+	for (i = 0; i < m->npatterns; i++)
+		if (!strcmp(m->patterns[i], pattern))
+			return (int)i;
+
+	patterns = realloc(m->patterns, sizeof(*patterns) * (m->npatterns + 1));
+	if (!patterns)
+		goto err;
+	m->patterns = patterns;
+	lengths = realloc(m->lengths, sizeof(*lengths) * (m->npatterns + 1));
+	if (!lengths)
 		goto err;
+	m->lengths = lengths;
 
-	qsort(ptrs, n, sizeof(char *), str_cmp);
-	str = ptrs[0];
-	for (i = 1; i < n; i++) {
-		str = realloc(str, strlen(str) + strlen(ptrs[i]) + 3);
-		if (!str)
-			goto err;
-		strcat(str, "+");
-		strcat(str, ptrs[i]);
-		free(ptrs[i]);
-	}
-	return str;
+	if ((m->patterns[m->npatterns] = strdup(pattern)) == NULL)
+		goto err;
+	m->lengths[m->npatterns] = strlen(pattern);
+
+	return (int)m->npatterns++;
 err:
-	fprintf(stderr, "Out of memory allocating string\n");
+	fprintf(stderr, "Out of memory allocating matcher pattern\n");
 	exit(EXIT_FAILURE);
 }
 
 /*
- *  suspend_blocker()
- *	parse a kernel log looking for suspend/resume and wakelocks
+ *  matcher_compile()
+ *	build an Aho-Corasick automaton of all the patterns and flatten
+ *	it into a DFA so that each byte of input costs one table lookup
  */
-static void suspend_blocker(
-	FILE *fp,
-	const char *filename,
-	json_object *json_results,
-	const int opt_freq_min)
+static void matcher_compile(matcher_t *m)
 {
-	char buf[4096];
-	char wakelock[4096];
-	char *resume_cause = NULL;
-	char *suspend_fail_cause = NULL;
-	int state = STATE_UNDEFINED;
-	timestamp suspend_start, suspend_exit;
-	double last_exit;
-	int suspend_succeeded = 0;
-	int suspend_failed = 0;
-	int suspend_count;
-	double interval_mode, interval_median, suspend_mode, suspend_median;
-	double interval_mean, interval_min, interval_max = 0.0, interval_sum, interval_percent;
-	double suspend_mean, suspend_min, suspend_max, suspend_sum, suspend_percent;
-	double total_percent;
-	double percent_succeeded, percent_failed;
-	double suspend_duration_parsed = -1.0;
-	time_delta_info *suspend_list = NULL;
-	time_delta_info *suspend_duration_list = NULL;
-	bool needs_config_suspend_time = true;
-	json_object *result = NULL, *obj;
+	uint32_t i, c, max_states = 1, head, tail;
+	uint32_t *fail, *queue;
+	size_t n;
+
+	/* Bytes that never appear in a pattern all share class 0 */
+	memset(m->class, 0, sizeof(m->class));
+	m->classes = 1;
+	for (i = 0; i < m->npatterns; i++) {
+		for (n = 0; n < m->lengths[i]; n++) {
+			uint8_t ch = (uint8_t)m->patterns[i][n];
+
+			if (!m->class[ch])
+				m->class[ch] = (uint8_t)m->classes++;
+		}
+		max_states += m->lengths[i];
+	}
+
+	m->next = calloc((size_t)max_states * m->classes, sizeof(*m->next));
+	m->out = malloc(max_states * sizeof(*m->out));
+	m->dict = calloc(max_states, sizeof(*m->dict));
+	fail = calloc(max_states, sizeof(*fail));
+	queue = malloc(max_states * sizeof(*queue));
+	if (!m->next || !m->out || !m->dict || !fail || !queue) {
+		fprintf(stderr, "Out of memory allocating matcher\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < max_states; i++)
+		m->out[i] = -1;
+
+	/* Build the trie, state 0 is the root */
+	m->states = 1;
+	for (i = 0; i < m->npatterns; i++) {
+		uint32_t s = 0;
+
+		for (n = 0; n < m->lengths[i]; n++) {
+			uint32_t *t = &m->next[s * m->classes +
+				m->class[(uint8_t)m->patterns[i][n]]];
+			if (!*t)
+				*t = m->states++;
+			s = *t;
+		}
+		m->out[s] = (int32_t)i;
+	}
 
-	counter_info wakelocks_count[HASH_SIZE];
-	counter_info resume_causes[HASH_SIZE];
-	counter_info suspend_fail_causes[HASH_SIZE];
-	counter_info wakeup_sources[HASH_SIZE];
+	/*
+	 *  Breadth first walk to set failure links and fill in the
+	 *  missing transitions from the failure state's transitions
+	 */
+	head = tail = 0;
+	for (c = 0; c < m->classes; c++) {
+		uint32_t t = m->next[c];
 
-	if (json_results) {
-		if ((result = json_obj()) == NULL)
-			goto out;
-		json_object_array_add(json_results, result);
+		if (t)
+			queue[tail++] = t;
+	}
+	while (head < tail) {
+		uint32_t s = queue[head++];
 
-		if ((obj = json_str(filename)) == NULL)
-			goto out;
-		json_object_object_add(result, "kernel-log", obj);
+		m->dict[s] = (m->out[fail[s]] >= 0) ? fail[s] : m->dict[fail[s]];
+		for (c = 0; c < m->classes; c++) {
+			uint32_t *t = &m->next[s * m->classes + c];
+			const uint32_t f = m->next[fail[s] * m->classes + c];
+
+			if (*t) {
+				fail[*t] = f;
+				queue[tail++] = *t;
+			} else {
+				*t = f;
+			}
+		}
 	}
 
-	memset(wakelocks_count, 0, sizeof(wakelocks_count));
-	memset(resume_causes, 0, sizeof(resume_causes));
-	memset(suspend_fail_causes, 0, sizeof(suspend_fail_causes));
-	memset(wakeup_sources, 0, sizeof(wakeup_sources));
+	/*
+	 *  Scale transitions to row offsets so the scan loop needs no
+	 *  multiply, and flag states that have output to report
+	 */
+	for (i = 0; i < m->states * m->classes; i++) {
+		const uint32_t t = m->next[i];
 
-	last_exit = -1.0;
+		m->next[i] = (t * m->classes) |
+			(((m->out[t] >= 0) || m->dict[t]) ? MATCHER_OUTPUT : 0);
+	}
 
-	if (opt_flags & OPT_VERBOSE)
-		print("       When         Duration (Seconds)\n");
+	free(queue);
+	free(fail);
+}
 
-	timestamp_init(&suspend_start);
-	timestamp_init(&suspend_exit);
+/*
+ *  matcher_free()
+ *	free matcher
+ */
+static void matcher_free(matcher_t *m)
+{
+	uint32_t i;
+
+	for (i = 0; i < m->npatterns; i++)
+		free(m->patterns[i]);
+	free(m->patterns);
+	free(m->lengths);
+	free(m->next);
+	free(m->out);
+	free(m->dict);
+	memset(m, 0, sizeof(*m));
+}
 
-	while (fgets(buf, sizeof(buf), fp) != NULL) {
-		char *ptr, *cause;
-		size_t len = strlen(buf);
+/*
+ *  matches_init()
+ *	initialise per line match results for matcher m
+ */
+static void matches_init(matches_t *mt, const matcher_t *m)
+{
+	mt->seen = calloc(m->npatterns, sizeof(*mt->seen));
+	mt->offset = calloc(m->npatterns, sizeof(*mt->offset));
+	if (!mt->seen || !mt->offset) {
+		fprintf(stderr, "Out of memory allocating matches\n");
+		exit(EXIT_FAILURE);
+	}
+	mt->generation = 0;
+	mt->hits = 0;
+}
 
-		if (buf[len - 1] == '\n')
-			buf[len - 1] = '\0';
+/*
+ *  matches_free()
+ *	free match results
+ */
+static void matches_free(matches_t *mt)
+{
+	free(mt->seen);
+	free(mt->offset);
+	mt->seen = NULL;
+	mt->offset = NULL;
+}
 
-		ptr = strstr(buf, "PM: suspend entry");
-		if (ptr) {
-			state = STATE_ENTER_SUSPEND;
-			parse_pm_timestamp(ptr + 18, &suspend_start);
-			suspend_duration_parsed = -1.0;
+/*
+ *  matcher_scan()
+ *	find the first occurrence of every pattern in a line in a
+ *	single pass, results are valid until the next scan
+ */
+static void matcher_scan(
+	const matcher_t *m,
+	matches_t *mt,
+	const char *line,
+	const size_t len)
+{
+	uint32_t v = 0;
+	size_t i;
+
+	/* Bumping the generation invalidates all previous matches */
+	if (++mt->generation == 0) {
+		memset(mt->seen, 0, m->npatterns * sizeof(*mt->seen));
+		mt->generation = 1;
+	}
+	mt->hits = 0;
+
+	for (i = 0; i < len; i++) {
+		uint32_t s, t;
+
+		v = m->next[(v & ~MATCHER_OUTPUT) + m->class[(uint8_t)line[i]]];
+		if (!(v & MATCHER_OUTPUT))
 			continue;
+
+		s = (v & ~MATCHER_OUTPUT) / m->classes;
+		for (t = (m->out[s] >= 0) ? s : m->dict[s]; t; t = m->dict[t]) {
+			const int32_t id = m->out[t];
+
+			if (mt->seen[id] != mt->generation) {
+				mt->seen[id] = mt->generation;
+				mt->offset[id] = i + 1 - m->lengths[id];
+				mt->hits++;
+			}
 		}
-		ptr = strstr(buf, "PM: suspend exit");
-		if (ptr) {
-			parse_pm_timestamp(ptr + 17, &suspend_exit);
+	}
+}
+
+/*
+ *  matches_truncate()
+ *	drop matches that no longer fit in a line truncated at offset at
+ */
+static void matches_truncate(const matcher_t *m, matches_t *mt, const size_t at)
+{
+	uint32_t i;
+
+	for (i = 0; i < m->npatterns; i++) {
+		if ((mt->seen[i] == mt->generation) &&
+		    (mt->offset[i] + m->lengths[i] > at)) {
+			mt->seen[i] = 0;
+			mt->hits--;
 		}
+	}
+}
 
-		if (strstr(buf, "suspend: enter suspend")) {
-			state = STATE_ENTER_SUSPEND;
-			parse_timestamp(buf, &suspend_start);
-			suspend_duration_parsed = -1.0;
-			continue;
+/*
+ *  match()
+ *	return pointer to first occurrence of pattern id in line,
+ *	or NULL if it was not found by the last matcher_scan()
+ */
+static inline char *match(const matches_t *mt, char *line, const int id)
+{
+	return (mt->seen[id] == mt->generation) ? line + mt->offset[id] : NULL;
+}
+
+/*
+ *  rules_add()
+ *	add a rule before rule index at
+ */
+static void rules_add(const rule_t *rule, const size_t at)
+{
+	rule_t *new_rules;
+
+	new_rules = realloc(rules, sizeof(*rules) * (nrules + 1));
+	if (!new_rules) {
+		fprintf(stderr, "Out of memory allocating rules\n");
+		exit(EXIT_FAILURE);
+	}
+	rules = new_rules;
+	memmove(&rules[at + 1], &rules[at], sizeof(*rules) * (nrules - at));
+	rules[at] = *rule;
+	nrules++;
+}
+
+/*
+ *  rule_field()
+ *	get the next key=value field of a rules file line, values
+ *	may be "quoted" with \ escapes. Returns NULL at the end of
+ *	the line, value is NULL if the field is malformed.
+ */
+static char *rule_field(char **pptr, char **value)
+{
+	char *ptr = *pptr, *key, *dst;
+
+	while (isspace((unsigned char)*ptr))
+		ptr++;
+	if (!*ptr || (*ptr == '#'))
+		return NULL;
+
+	key = ptr;
+	while (*ptr && (*ptr != '=') && !isspace((unsigned char)*ptr))
+		ptr++;
+	if (*ptr != '=') {
+		*value = NULL;
+		return key;
+	}
+	*ptr++ = '\0';
+	*value = dst = ptr;
+
+	if (*ptr == '"') {
+		for (ptr++; *ptr && (*ptr != '"'); ptr++) {
+			if ((*ptr == '\\') && ptr[1]) {
+				ptr++;
+				*dst++ = (*ptr == 'n') ? '\n' :
+					 (*ptr == 't') ? '\t' : *ptr;
+			} else {
+				*dst++ = *ptr;
+			}
 		}
-		if (strstr(buf, "PM: Entering mem sleep")) {
-			state = STATE_ENTER_SUSPEND;
-			parse_timestamp(buf, &suspend_start);
-			suspend_duration_parsed = -1.0;
-			continue;
+		if (*ptr != '"') {
+			*value = NULL;
+			return key;
 		}
-		if (strstr(buf, "PM: Preparing system for mem sleep")) {
-			state = STATE_ENTER_SUSPEND;
-			parse_timestamp(buf, &suspend_start);
-			suspend_duration_parsed = -1.0;
-			continue;
+		ptr++;
+	} else {
+		while (*ptr && !isspace((unsigned char)*ptr))
+			ptr++;
+		dst = ptr;
+	}
+	if (*ptr)
+		ptr++;
+	*dst = '\0';
+	*pptr = ptr;
+
+	return key;
+}
+
+/*
+ *  phase_find()
+ *	suspend phase of a phase name, -1 if there is none
+ */
+static int phase_find(const char *name)
+{
+	int i;
+
+	for (i = 0; i < PHASE_MAX; i++)
+		if (!strcmp(phase_names[i].name, name))
+			return i;
+	return -1;
+}
+
+/*
+ *  phase_seconds()
+ *	latency in seconds of a phase argument such as "120.345 msecs"
+ *	or "0.002 seconds", -1.0 if it is not a latency
+ */
+static double phase_seconds(const char *arg)
+{
+	char *end;
+	double v = strtod(arg, &end);
+
+	if ((end == arg) || !(v >= 0.0) || !isfinite(v))
+		return -1.0;
+	while (*end == ' ')
+		end++;
+	if (!strncmp(end, "msec", 4) || !strncmp(end, "ms", 2))
+		return v / 1000.0;
+	if (!strncmp(end, "usec", 4) || !strncmp(end, "us", 2))
+		return v / 1000000.0;
+	return v;
+}
+
+/*
+ *  rule_lookup()
+ *	look up a ',' separated list of names, returns the
+ *	values or'd together or -1 if a name is unknown
+ */
+static int rule_lookup(const rule_name_t *names, char *list)
+{
+	char *name, *saveptr = NULL;
+	int value = 0;
+
+	for (name = strtok_r(list, ",", &saveptr); name;
+	     name = strtok_r(NULL, ",", &saveptr)) {
+		const rule_name_t *n;
+
+		for (n = names; n->name; n++)
+			if (!strcmp(n->name, name))
+				break;
+		if (!n->name)
+			return -1;
+		value |= n->value;
+	}
+	return value;
+}
+
+/*
+ *  rule_strdup()
+ *	duplicate a rule string into the copy the rule owns
+ */
+static char *rule_strdup(char **copy, const char *str)
+{
+	free(*copy);
+	*copy = strdup(str);
+	if (!*copy) {
+		fprintf(stderr, "Out of memory allocating rule\n");
+		exit(EXIT_FAILURE);
+	}
+	return *copy;
+}
+
+/*
+ *  rules_read()
+ *	read extra rules from a file, one rule per line as key=value
+ *	fields, for example:
+ *	  pattern="wake up from" offset=13 action=resume-cause
+ *	  set=resume-cause counter=resume-causes phase=before
+ *	Rules in phase "before" are tried before the suspend exit is
+ *	accounted for, by default rules are tried after all others.
+ */
+static void rules_read(const char *filename)
+{
+	FILE *fp;
+	char *line = NULL;
+	size_t line_size = 0, before;
+	int lineno = 0;
+
+	if ((fp = fopen(filename, "r")) == NULL) {
+		fprintf(stderr, "Cannot open rules file %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Rules in phase "before" go in front of the suspend exit rule */
+	for (before = 0; before < nrules; before++)
+		if (rules[before].action == ACT_SUSPEND_DONE)
+			break;
+
+	while (getline(&line, &line_size, fp) != -1) {
+		rule_t rule;
+		char *ptr = line, *key, *value;
+		bool phase_before = false;
+
+		lineno++;
+		memset(&rule, 0, sizeof(rule));
+
+		while ((key = rule_field(&ptr, &value)) != NULL) {
+			int v = 0;
+
+			if (!value)
+				goto bad_field;
+			if (!strcmp(key, "pattern") && *value)
+				rule.pattern = rule_strdup(&rule.pattern_copy, value);
+			else if (!strcmp(key, "also") && *value)
+				rule.also = rule_strdup(&rule.also_copy, value);
+			else if (!strcmp(key, "stop"))
+				rule.stop = rule_strdup(&rule.stop_copy, value);
+			else if (!strcmp(key, "name"))
+				rule.name = rule_strdup(&rule.name_copy, value);
+			else if (!strcmp(key, "offset") && ((rule.offset = atoi(value)) >= 0))
+				;
+			else if (!strcmp(key, "action") && ((v = rule_lookup(rule_actions, value)) >= 0))
+				rule.action = v;
+			else if (!strcmp(key, "counter") && ((v = rule_lookup(rule_counters, value)) >= 0))
+				rule.counter = v;
+			else if (!strcmp(key, "need") && ((v = rule_lookup(rule_states, value)) >= 0))
+				rule.need = v;
+			else if (!strcmp(key, "clear") && ((v = rule_lookup(rule_states, value)) >= 0))
+				rule.clear = v;
+			else if (!strcmp(key, "set") && ((v = rule_lookup(rule_states, value)) >= 0))
+				rule.set = v;
+			else if (!strcmp(key, "also-set") && ((v = rule_lookup(rule_states, value)) >= 0))
+				rule.also_set = v;
+			else if (!strcmp(key, "last") && (!strcmp(value, "yes") || !strcmp(value, "no")))
+				rule.last = !strcmp(value, "yes");
+			else if (!strcmp(key, "phase") && (!strcmp(value, "before") || !strcmp(value, "after")))
+				phase_before = !strcmp(value, "before");
+			else
+				goto bad_field;
 		}
-		if (strstr(buf, "PM: Some devices failed to suspend")) {
-			state |= STATE_SUSPEND_FAIL_CAUSE;
-			/* Pick first failure cause up, ignore rest */
-			if (!suspend_fail_cause) {
-				suspend_fail_cause = strdup("device suspend failure");
-				counter_increment(suspend_fail_cause, suspend_fail_causes);
+		if (!rule.pattern) {
+			if (rule.also || rule.stop || rule.name || rule.action ||
+			    rule.counter || rule.need || rule.clear || rule.set) {
+				fprintf(stderr, "%s:%d: rule has no pattern\n",
+					filename, lineno);
+				exit(EXIT_FAILURE);
 			}
+			/* Blank and comment lines */
 			continue;
 		}
-
-		ptr = strstr(buf, "active wakeup source: ");
-		if (ptr) {
-			ptr += 22;
-			if (*ptr)
-				counter_increment(ptr, wakeup_sources);
+		if ((rule.action == ACT_PHASE_TIME) && (!rule.name || (phase_find(rule.name) < 0))) {
+			fprintf(stderr, "%s:%d: phase-time rule needs the name of a suspend phase\n",
+				filename, lineno);
+			exit(EXIT_FAILURE);
 		}
+		if (phase_before)
+			rules_add(&rule, before++);
+		else
+			rules_add(&rule, nrules);
+		continue;
+bad_field:
+		fprintf(stderr, "%s:%d: bad rule field '%s'\n", filename, lineno, key);
+		exit(EXIT_FAILURE);
+	}
+	free(line);
+	(void)fclose(fp);
+}
 
-		ptr = strstr(buf, "Resume caused by");
-		if (ptr)
-			cause = ptr + 17;
-		else {
-			ptr = strstr(buf, "[SPM] wake up by");
-			if (ptr) {
-				char *ws;
-
-				cause = ptr + 17;
-				ws = strchr(cause, ' ');
-				if (ws)
-					*ws = '\0';
-				ws = strchr(cause, ',');
-				if (ws)
-					*ws = '\0';
-			}
-		}
-		if (ptr) {
-			state |= STATE_RESUME_CAUSE;
-			resume_cause = str_sort_add(resume_cause, cause);
-			if (opt_flags & OPT_RESUME_CAUSES)
-				counter_increment(cause, resume_causes);
-		}
+/*
+ *  patterns_compile()
+ *	build the rules, built in and from any rules file, and
+ *	compile their markers into the matcher
+ */
+static void patterns_compile(const char *rules_file)
+{
+	size_t i;
 
-		/* In this form, we have a pretty good idea what the suspend duration is */
-		ptr = strstr(buf, "Suspended for");
-		if (ptr) {
-			suspend_duration_parsed = atof(ptr + 14);
-			needs_config_suspend_time = false;
-		}
+	for (i = 0; i < sizeof(builtin_rules) / sizeof(builtin_rules[0]); i++) {
+		const int opts = action_opts[builtin_rules[i].action];
 
-		if (strstr(buf, "suspend: exit suspend") ||
-                    strstr(buf, "PM: suspend exit")) {
-			if (state & STATE_ENTER_SUSPEND) {
-				state &= ~STATE_ENTER_SUSPEND;
-				state |= STATE_EXIT_SUSPEND;
-				parse_timestamp(buf, &suspend_exit);
-			}
+		if (!opts || (opt_flags & opts))
+			rules_add(&builtin_rules[i], nrules);
+	}
+	if (rules_file)
+		rules_read(rules_file);
+
+	for (i = 0; i < nrules; i++) {
+		if (rules[i].pattern)
+			rules[i].id = matcher_add(&matcher, rules[i].pattern);
+		if (rules[i].also)
+			rules[i].also_id = matcher_add(&matcher, rules[i].also);
+	}
+	matcher_compile(&matcher);
+}
+
+/*
+ *  patterns_free()
+ *	free the rules and the matcher
+ */
+static void patterns_free(void)
+{
+	size_t i;
+
+	for (i = 0; i < nrules; i++) {
+		free(rules[i].pattern_copy);
+		free(rules[i].also_copy);
+		free(rules[i].stop_copy);
+		free(rules[i].name_copy);
+	}
+	free(rules);
+	rules = NULL;
+	nrules = 0;
+	matcher_free(&matcher);
+}
+
+/*
+ *  klog_new()
+ *	create a new kernel log parser
+ */
+static klog_t *klog_new(const char *filename)
+{
+	klog_t *klog;
+
+	klog = calloc(1, sizeof(*klog));
+	if (!klog) {
+		fprintf(stderr, "Out of memory allocating kernel log parser\n");
+		exit(EXIT_FAILURE);
+	}
+	klog->filename = filename;
+	klog->state = STATE_UNDEFINED;
+	klog->last_exit = -1.0;
+	klog->suspend_duration_parsed = -1.0;
+	klog->needs_config_suspend_time = true;
+	klog->suspend_fail_cause = -1;
+	klog->device_phase = PHASE_SUSPEND;
+	klog->kmsg = !!(opt_flags & OPT_KMSG);
+	klog->warmup = !!(opt_flags & OPT_SINCE);
+	timestamp_init(&klog->suspend_start);
+	timestamp_init(&klog->suspend_exit);
+	matches_init(&klog->matches, &matcher);
+	klog->wakelocks_count.names = &klog->names;
+	klog->resume_causes.names = &klog->names;
+	klog->suspend_fail_causes.names = &klog->names;
+	klog->wakeup_sources.names = &klog->names;
+	if (opt_flags & OPT_PHASES) {
+		klog->phases = calloc(PHASE_MAX, sizeof(*klog->phases));
+		if (!klog->phases) {
+			fprintf(stderr, "Out of memory allocating phase latencies\n");
+			exit(EXIT_FAILURE);
 		}
+	}
 
-		if (state & STATE_EXIT_SUSPEND) {
-			double s_start = 0.0, s_exit = 0.0, s_duration = 0.0;
-			bool s_duration_accurate = false;
-			bool valid = false;
+	return klog;
+}
 
-			/*  1st, check least inaccurate way of measuring suspend */
-			if (suspend_start.whence_valid && suspend_exit.whence_valid) {
-				s_start    = suspend_start.whence;
-				s_exit     = suspend_exit.whence;
-				s_duration = s_exit - s_start;
-				valid = true;
-			}
-			/*  2nd, if we have suspend_duration_parsed, then use this */
-			if (suspend_duration_parsed > 0.0) {
-				s_duration = suspend_duration_parsed;
-				suspend_duration_parsed = -1.0;
-				s_duration_accurate = true;
-				valid = true;
-			}
-			/*  3rd, most accurate estimate should always be considered */
-			if (suspend_start.pm_whence_valid && suspend_exit.pm_whence_valid) {
-				s_start = suspend_start.pm_whence;
-				s_exit  = suspend_exit.pm_whence;
-				s_duration = s_exit - s_start;
-				s_duration_accurate = true;
-				valid = true;
-			}
+/*
+ *  phases_reset()
+ *	forget the suspend phase latencies, -p
+ */
+static void phases_reset(klog_t *klog)
+{
+	int i;
 
-			if (opt_flags & OPT_VERBOSE)
-				print("%-15s %11.5f ",
-					*suspend_start.whence_text ? suspend_start.whence_text : "<unknown>",
-					s_duration);
+	for (i = 0; klog->phases && (i < PHASE_MAX); i++) {
+		histogram_free(&klog->phases[i].histogram);
+		memset(&klog->phases[i].sketch, 0, sizeof(klog->phases[i].sketch));
+	}
+	klog->phase_seen = 0;
+}
 
-			timestamp_init(&suspend_start);
-			timestamp_init(&suspend_exit);
+/*
+ *  phases_free()
+ *	free the suspend phase latencies, -p
+ */
+static void phases_free(klog_t *klog)
+{
+	phases_reset(klog);
+	free(klog->phases);
+	klog->phases = NULL;
+}
 
-			if (state & STATE_SUSPEND_SUCCESS) {
-				time_delta_info *new_info;
+/*
+ *  callbacks_free()
+ *	free the device callback latencies, -c
+ */
+static void callbacks_free(klog_t *klog)
+{
+	uint32_t i;
 
-				if (opt_flags & OPT_VERBOSE) {
-					print("Successful suspend");
-					if (resume_cause && (state & STATE_RESUME_CAUSE)) {
-						print(", resume cause: %s", resume_cause);
-					}
-				}
+	for (i = 0; i < klog->callbacks_size; i++)
+		free(klog->callbacks[i].bins);
+	free(klog->callbacks);
+	klog->callbacks = NULL;
+	klog->callbacks_size = 0;
+}
 
-				if (valid && last_exit > 0.0) {
-					char buffer[1024];
-					double delta = s_start - last_exit;
-
-					if (delta > 0.0) {
-						new_info = malloc(sizeof(time_delta_info));
-						if (!new_info) {
-							fprintf(stderr, "Out of memory!\n");
-							exit(EXIT_FAILURE);
-						}
-						new_info->type = SUSPEND_SUCCESS;
-						snprintf(buffer, sizeof(buffer), "R:%s", resume_cause);
-						new_info->reason = strdup(buffer);
-						new_info->start = s_start;
-						new_info->delta = s_start - last_exit;
-						new_info->accurate = true;
-						new_info->next = suspend_list;
-						suspend_list = new_info;
-						if (interval_max < new_info->delta)
-							interval_max = new_info->delta;
-					}
-				}
-				if (s_duration > 0.0) {
-					char buffer[1024];
-
-					new_info = malloc(sizeof(time_delta_info));
-					if (!new_info) {
-						fprintf(stderr, "Out of memory!\n");
-						exit(EXIT_FAILURE);
-					}
-					snprintf(buffer, sizeof(buffer), "R:%s", resume_cause);
-					new_info->reason = strdup(buffer);
-					new_info->type = SUSPEND_DURATION;
-					new_info->start = s_start;
-					new_info->delta = s_duration;
-					new_info->accurate = s_duration_accurate;
-					new_info->next = suspend_duration_list;
-					suspend_duration_list = new_info;
-				}
-				free(resume_cause);
-				resume_cause = NULL;
-				suspend_succeeded++;
+/*
+ *  storms_free()
+ *	free the wakeup windows and storms, -W
+ */
+static void storms_free(klog_t *klog)
+{
+	uint32_t i;
+
+	for (i = 0; i < klog->storm_keys_size; i++)
+		free(klog->storm_keys[i].times);
+	free(klog->storm_keys);
+	free(klog->storms);
+	klog->storm_keys = NULL;
+	klog->storm_keys_size = 0;
+	klog->storms = NULL;
+	klog->nstorms = 0;
+	klog->storms_size = 0;
+	klog->storm_npending = 0;
+}
 
-				last_exit = s_exit;
-			} else {
-				time_delta_info *new_info;
+/*
+ *  klog_free()
+ *	free kernel log parser
+ */
+static void klog_free(klog_t *klog)
+{
+	matches_free(&klog->matches);
+	free(klog->buf);
+	free(klog->partial);
+	free(klog->causes);
+	events_free(&klog->suspend_list);
+	events_free(&klog->suspend_duration_list);
+	histograms_free(&klog->histograms);
+	phases_free(klog);
+	callbacks_free(klog);
+	strtab_free(&klog->devices);
+	storms_free(klog);
+	free(klog->storm_pending);
+	if (klog->index)
+		(void)munmap(klog->index, klog->index_size);
+	counter_free(&klog->wakelocks_count);
+	counter_free(&klog->resume_causes);
+	counter_free(&klog->suspend_fail_causes);
+	counter_free(&klog->wakeup_sources);
+	strtab_free(&klog->names);
+	strtab_free(&klog->sets);
+	free(klog);
+}
 
-				new_info = malloc(sizeof(time_delta_info));
-				if (!new_info) {
-					fprintf(stderr, "Out of memory!\n");
-					exit(EXIT_FAILURE);
-				}
-				new_info->type = SUSPEND_FAIL;
-				new_info->reason = NULL;
-				new_info->start = s_start;
-				new_info->delta = 0;
-				new_info->accurate = false;
-				new_info->next = suspend_list;
-				suspend_list = new_info;
-
-				suspend_failed++;
-				if (resume_cause && (state & STATE_RESUME_CAUSE)) {
-					char buffer[1024];
-
-					if (opt_flags & OPT_VERBOSE)
-						print("Suspend aborted, resume cause: %s\n", resume_cause);
-
-					snprintf(buffer, sizeof(buffer), "A:%s", resume_cause);
-					new_info->reason = strdup(buffer);
-					free(resume_cause);
-					resume_cause = NULL;
-					state = STATE_UNDEFINED;
-					continue;
-				}
-				if (suspend_fail_cause && (state & STATE_SUSPEND_FAIL_CAUSE)) {
-					char buffer[1024];
+/*
+ *  klog_timestamp()
+ *	get the timestamp of the current line, /dev/kmsg records carry
+ *	their timestamp in the record header rather than in the text
+ */
+static void klog_timestamp(klog_t *klog, const char *line, timestamp *ts)
+{
+	if (!klog->kmsg) {
+		parse_timestamp(line, ts);
+		return;
+	}
+	ts->whence = (double)klog->kmsg_usec / 1000000.0;
+	ts->whence_valid = true;
+	if (decimal_text(ts->whence_text, klog->kmsg_usec, 6, 6, 12, ' '))
+		strcat(ts->whence_text, "  ");
+	else
+		sprintf(ts->whence_text, "%12.6f  ", ts->whence);
+}
 
-					if (opt_flags & OPT_VERBOSE)
-						print("Suspend aborted, %s\n", suspend_fail_cause);
-					snprintf(buffer, sizeof(buffer), "A:%s", suspend_fail_cause);
+/*
+ *  klog_suspend_done()
+ *	account for a suspend attempt that has just exited, either
+ *	as a successful suspend or as a failure and its cause
+ */
+static void klog_suspend_done(klog_t *klog)
+{
+	double s_start = 0.0, s_exit = 0.0, s_duration = 0.0;
+	bool s_duration_accurate = false;
+	bool valid = false;
+	/* Suspends in the warm up before a -t window are not reported */
+	const bool verbose = (opt_flags & OPT_VERBOSE) && !klog->warmup;
+
+	/*  1st, check least inaccurate way of measuring suspend */
+	if (klog->suspend_start.whence_valid && klog->suspend_exit.whence_valid) {
+		s_start    = klog->suspend_start.whence;
+		s_exit     = klog->suspend_exit.whence;
+		s_duration = s_exit - s_start;
+		valid = true;
+	}
+	/*  2nd, if we have suspend_duration_parsed, then use this */
+	if (klog->suspend_duration_parsed > 0.0) {
+		s_duration = klog->suspend_duration_parsed;
+		klog->suspend_duration_parsed = -1.0;
+		s_duration_accurate = true;
+		valid = true;
+	}
+	/*  3rd, most accurate estimate should always be considered */
+	if (klog->suspend_start.pm_whence_valid && klog->suspend_exit.pm_whence_valid) {
+		s_start = klog->suspend_start.pm_whence;
+		s_exit  = klog->suspend_exit.pm_whence;
+		s_duration = s_exit - s_start;
+		s_duration_accurate = true;
+		valid = true;
+	}
 
-					new_info->reason = strdup(buffer);
-					free(suspend_fail_cause);
-					suspend_fail_cause = NULL;
-					state = STATE_UNDEFINED;
-				}
-				if (state & STATE_ACTIVE_WAKELOCK) {
-					char buffer[1024];
+	if (verbose)
+		print("%-15s %11.5f ",
+			*klog->suspend_start.whence_text ?
+				klog->suspend_start.whence_text : "<unknown>",
+			s_duration);
 
-					if (opt_flags & OPT_VERBOSE)
-						print("Failed on wakelock %s, ", wakelock);
+	timestamp_init(&klog->suspend_start);
+	timestamp_init(&klog->suspend_exit);
 
-					snprintf(buffer, sizeof(buffer), "F:%s", wakelock);
-					new_info->reason = strdup(buffer);
-				}
-				if (state & STATE_FREEZE_ABORTED) {
-					new_info->reason = strdup("freezer abort");
-					if (opt_flags & OPT_VERBOSE) {
-						if (state & STATE_FREEZE_TASKS_REFUSE)
-							print("Suspend aborted in freezer, tasks refused to freeze");
-						else
-							print("Suspend aborted in freezer");
-					}
-					new_info->reason = strdup("A:freezer");
-				}
-				if (state & STATE_LATE_HAS_WAKELOCK) {
-					if (opt_flags & OPT_VERBOSE)
-						print("Wakelock during power_suspend_late");
-					new_info->reason = strdup("A:wakelock");
-				}
+	if (klog->state & STATE_SUSPEND_SUCCESS) {
+		const int reason = klog_reason(klog, REASON_RESUMED,
+			klog->causes, klog->ncauses);
 
+		if (verbose) {
+			print("Successful suspend");
+			if (klog->ncauses && (klog->state & STATE_RESUME_CAUSE)) {
+				char *text = cause_set_text(&klog->names,
+					klog->causes, klog->ncauses);
+
+				print(", resume cause: %s", text);
+				free(text);
 			}
-			if (opt_flags & OPT_VERBOSE)
-				print("\n");
-			state = STATE_UNDEFINED;
-			continue;
 		}
 
-		ptr = strstr(buf, "active wake lock");
-		if (ptr && (state & STATE_ENTER_SUSPEND)) {
-			if ((sscanf(ptr + 17, "%[^,^\n]", wakelock) == 1) &&
-			    (opt_flags & OPT_WAKELOCK_BLOCKERS))
-				counter_increment(wakelock, wakelocks_count);
-			state |= STATE_ACTIVE_WAKELOCK;
-			continue;
+		if (valid && klog->last_exit > 0.0) {
+			double delta = s_start - klog->last_exit;
+
+			if (delta > 0.0) {
+				if (opt_flags & OPT_SKETCH)
+					sketch_add(&klog->interval_sketch, delta);
+				if (opt_flags & OPT_HISTOGRAM)
+					histogram_add(&klog->histograms.intervals, delta, true);
+				if (events_needed())
+					(void)events_add(&klog->suspend_list, SUSPEND_SUCCESS,
+						s_start, delta, true, reason);
+			}
 		}
-
-		ptr = strstr(buf, "Disabling non-boot CPUs");
-		if (ptr && (state & STATE_ENTER_SUSPEND)) {
-			state |= STATE_SUSPEND_SUCCESS;
-			continue;
+		if (s_duration > 0.0) {
+			if (opt_flags & OPT_SKETCH)
+				sketch_add(&klog->suspend_sketch, s_duration);
+			if (opt_flags & OPT_HISTOGRAM)
+				histogram_add(&klog->histograms.durations,
+					s_duration, s_duration_accurate);
+			if (events_needed())
+				(void)events_add(&klog->suspend_duration_list, SUSPEND_DURATION,
+					s_start, s_duration, s_duration_accurate, reason);
 		}
+		klog->ncauses = 0;
+		klog->suspend_succeeded++;
 
-		if (strstr(buf, "Freezing of user space  aborted") ||
-		    strstr(buf, "Freezing of user space aborted")) {
-			state |= STATE_FREEZE_ABORTED;
-			counter_increment("user space freezer abort", suspend_fail_causes);
-			continue;
+		klog->last_exit = s_exit;
+	} else {
+		int32_t none = REASON_NONE;
+		int32_t *reason = &none;
+
+		if (events_needed()) {
+			const size_t i = events_add(&klog->suspend_list, SUSPEND_FAIL,
+				s_start, 0.0, false, REASON_NONE);
+
+			reason = &klog->suspend_list.reason[i];
 		}
 
-		if (strstr(buf, "Freezing of tasks  aborted") ||
-                    strstr(buf, "Freezing of tasks aborted")) {
-			state |= STATE_FREEZE_ABORTED;
-			counter_increment("tasks freezer abort", suspend_fail_causes);
-			if (strstr(buf, "tasks refusing to freeze"))
-				state |= STATE_FREEZE_TASKS_REFUSE;
-			continue;
+		klog->suspend_failed++;
+		if (klog->ncauses && (klog->state & STATE_RESUME_CAUSE)) {
+			if (verbose) {
+				char *text = cause_set_text(&klog->names,
+					klog->causes, klog->ncauses);
+
+				print("Suspend aborted, resume cause: %s\n", text);
+				free(text);
+			}
+
+			*reason = klog_reason(klog, REASON_ABORTED,
+				klog->causes, klog->ncauses);
+			klog->ncauses = 0;
+			klog->state = STATE_UNDEFINED;
+			return;
 		}
+		if ((klog->suspend_fail_cause >= 0) && (klog->state & STATE_SUSPEND_FAIL_CAUSE)) {
+			const uint32_t id = (uint32_t)klog->suspend_fail_cause;
 
-		if (strstr(buf, "power_suspend_late return -11")) {
-			/* See power_suspend_late, has_wake_lock() true, so return -EAGAIN */
-			counter_increment("late suspend wakelock", suspend_fail_causes);
-			state |= STATE_LATE_HAS_WAKELOCK;
-			continue;
+			if (verbose)
+				print("Suspend aborted, %s\n", strtab_str(&klog->names, id));
+
+			*reason = klog_reason(klog, REASON_ABORTED, &id, 1);
+			klog->suspend_fail_cause = -1;
+			klog->state = STATE_UNDEFINED;
 		}
-	}
+		if (klog->state & STATE_ACTIVE_WAKELOCK) {
+			const uint32_t id = strtab_intern(&klog->names, klog->wakelock);
 
-	if (opt_flags & OPT_VERBOSE)
-		putchar('\n');
+			if (verbose)
+				print("Failed on wakelock %s, ", klog->wakelock);
 
-	suspend_count = suspend_failed + suspend_succeeded;
+			*reason = klog_reason(klog, REASON_FAILED, &id, 1);
+		}
+		if (klog->state & STATE_FREEZE_ABORTED) {
+			const uint32_t id = strtab_intern(&klog->names, "freezer");
 
-	if (opt_flags & OPT_WAKELOCK_BLOCKERS) {
-		print("Suspend blocking wakelocks:\n");
-		counter_dump(wakelocks_count, "suspend-blocking-wakelocks", result);
-	}
+			if (verbose) {
+				if (klog->state & STATE_FREEZE_TASKS_REFUSE)
+					print("Suspend aborted in freezer, tasks refused to freeze");
+				else
+					print("Suspend aborted in freezer");
+			}
+			*reason = klog_reason(klog, REASON_ABORTED, &id, 1);
+		}
+		if (klog->state & STATE_LATE_HAS_WAKELOCK) {
+			const uint32_t id = strtab_intern(&klog->names, "wakelock");
+
+			if (verbose)
+				print("Wakelock during power_suspend_late");
+			*reason = klog_reason(klog, REASON_ABORTED, &id, 1);
+		}
 
-	if (opt_flags & OPT_RESUME_CAUSES) {
-		print("Resume wakeup causes:\n");
-		counter_dump(resume_causes, "resume-wakeups", result);
-		print("Suspend failure causes:\n");
-		counter_dump(suspend_fail_causes, "suspend-failures", result);
-		printf("Active wakeup sources:\n");
-		counter_dump(wakeup_sources, "wakeup-sources", result);
 	}
+	if (verbose)
+		print("\n");
+	klog->state = STATE_UNDEFINED;
+}
 
-	time_calc_stats(suspend_list, &interval_mode, &interval_median,
-		&interval_mean, &interval_min, &interval_max, &interval_sum);
-	time_calc_stats(suspend_duration_list, &suspend_mode, &suspend_median,
-		&suspend_mean, &suspend_min, &suspend_max, &suspend_sum);
+/*
+ *  klog_counter()
+ *	get a counter of the kernel log parser
+ */
+static counter_info *klog_counter(klog_t *klog, const int counter)
+{
+	switch (counter) {
+	case COUNTER_WAKELOCKS:
+		return &klog->wakelocks_count;
+	case COUNTER_RESUME_CAUSES:
+		return &klog->resume_causes;
+	case COUNTER_SUSPEND_FAILURES:
+		return &klog->suspend_fail_causes;
+	case COUNTER_WAKEUP_SOURCES:
+		return &klog->wakeup_sources;
+	default:
+		return NULL;
+	}
+}
+
+/*
+ *  klog_phases_done()
+ *	account for the phase latencies of a finished suspend attempt,
+ *	a phase that was logged more than once in the attempt counts
+ *	the sum of its latencies
+ */
+static void klog_phases_done(klog_t *klog)
+{
+	const bool verbose = (opt_flags & OPT_VERBOSE) && !klog->warmup;
+	int i;
+
+	if (!klog->phase_seen)
+		return;
+
+	if (verbose)
+		print("%-27s", "  Phases (ms):");
+	for (i = 0; i < PHASE_MAX; i++) {
+		if (!(klog->phase_seen & (1U << i)))
+			continue;
+		sketch_add(&klog->phases[i].sketch, klog->phase_times[i]);
+		if (opt_flags & OPT_HISTOGRAM)
+			histogram_add(&klog->phases[i].histogram, klog->phase_times[i], true);
+		if (verbose)
+			print(" %s %.3f", phase_names[i].name, klog->phase_times[i] * 1000.0);
+		klog->phase_times[i] = 0.0;
+	}
+	if (verbose)
+		print("\n");
+	klog->phase_seen = 0;
+}
+
+/*
+ *  callback_device()
+ *	copy the device of a device callback line into dev, either the
+ *	old "call 1-1+ returned" or the dev_info() "usb 1-1: ... returned"
+ *	format, NULL if the line is not a device callback. The line is
+ *	left as it is for the rules that follow.
+ */
+static char *callback_device(const char *buf, const char *ptr, char *dev, const size_t size)
+{
+	const char *msg = strstr(buf, "] "), *end;
+	size_t len;
+
+	/* Message text starts after any timestamp */
+	msg = (msg && (msg < ptr)) ? msg + 2 : buf;
+	if (!strncmp(msg, "call ", 5)) {
+		msg += 5;
+		end = ptr;
+		if ((end > msg) && (end[-1] == '+'))
+			end--;
+	} else {
+		end = strstr(msg, ": ");
+		if (end && (end + 2 > ptr))
+			end = NULL;
+	}
+	if (!end || (end <= msg))
+		return NULL;
+	len = (size_t)(end - msg);
+	if (len >= size)
+		len = size - 1;
+	memcpy(dev, msg, len);
+	dev[len] = '\0';
+	return dev;
+}
+
+/*
+ *  klog_callback()
+ *	account for the latency of a device suspend or resume callback,
+ *	arg is "0 after 1234 usecs", -c
+ */
+static void klog_callback(klog_t *klog, const char *buf, const char *ptr, const char *arg)
+{
+	char device[256];
+	callback_stat_t *stat;
+	uint32_t id;
+	double v;
+	char *end;
+	int i;
+
+	(void)strtol(arg, &end, 10);
+	if ((end == arg) || strncmp(end, " after ", 7))
+		return;
+	if ((v = phase_seconds(end + 7)) < 0.0)
+		return;
+	if (!callback_device(buf, ptr, device, sizeof(device)))
+		return;
+
+	id = strtab_intern(&klog->devices, device) * PHASE_MAX + (uint32_t)klog->device_phase;
+	if (id >= klog->callbacks_size) {
+		uint32_t size = klog->callbacks_size ? klog->callbacks_size * 2 : 256;
+		callback_stat_t *callbacks;
+
+		while (size <= id)
+			size *= 2;
+		callbacks = realloc(klog->callbacks, sizeof(*callbacks) * size);
+		if (!callbacks) {
+			fprintf(stderr, "Out of memory allocating device callbacks\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(callbacks + klog->callbacks_size, 0,
+			sizeof(*callbacks) * (size - klog->callbacks_size));
+		klog->callbacks = callbacks;
+		klog->callbacks_size = size;
+	}
+	stat = &klog->callbacks[id];
+	if (!stat->bins) {
+		stat->bins = calloc(CALLBACK_BINS, sizeof(*stat->bins));
+		if (!stat->bins) {
+			fprintf(stderr, "Out of memory allocating device callbacks\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	stat->count++;
+	stat->total += v;
+	if (stat->max < v)
+		stat->max = v;
+	i = (v * 1000000.0 > 1.0) ?
+		(int)ceil(CALLBACK_BINS_PER_2 * log2(v * 1000000.0)) : 0;
+	stat->bins[i < CALLBACK_BINS ? i : CALLBACK_BINS - 1]++;
+}
+
+/*
+ *  klog_storm_pending()
+ *	remember a resume cause or wakeup source until the time of
+ *	the suspend attempt it woke or aborted is known, -W
+ */
+static void klog_storm_pending(klog_t *klog, const char *name, const bool source)
+{
+	if (klog->storm_npending == klog->storm_pending_size) {
+		const uint32_t size = klog->storm_pending_size ? klog->storm_pending_size * 2 : 8;
+		uint32_t *pending = realloc(klog->storm_pending, sizeof(*pending) * size);
+
+		if (!pending) {
+			fprintf(stderr, "Out of memory allocating wakeup storms\n");
+			exit(EXIT_FAILURE);
+		}
+		klog->storm_pending = pending;
+		klog->storm_pending_size = size;
+	}
+	klog->storm_pending[klog->storm_npending++] =
+		strtab_intern(&klog->names, name) * 2 + source;
+}
+
+/*
+ *  klog_storm_add()
+ *	add a wakeup at time t to the sliding window of its key, the
+ *	window is a ring of the last opt_storm_count wakeup times so a
+ *	storm is when the oldest of them is within opt_storm_window
+ *	seconds of t, this is O(1) for each wakeup
+ */
+static void klog_storm_add(klog_t *klog, const uint32_t key, const double t, const bool wall)
+{
+	storm_key_t *k;
+
+	if (key >= klog->storm_keys_size) {
+		uint32_t size = klog->storm_keys_size ? klog->storm_keys_size * 2 : 64;
+		storm_key_t *keys;
+
+		while (size <= key)
+			size *= 2;
+		keys = realloc(klog->storm_keys, sizeof(*keys) * size);
+		if (!keys) {
+			fprintf(stderr, "Out of memory allocating wakeup storms\n");
+			exit(EXIT_FAILURE);
+		}
+		memset(keys + klog->storm_keys_size, 0,
+			sizeof(*keys) * (size - klog->storm_keys_size));
+		klog->storm_keys = keys;
+		klog->storm_keys_size = size;
+	}
+	k = &klog->storm_keys[key];
+	if (!k->times) {
+		k->times = calloc(opt_storm_count, sizeof(*k->times));
+		if (!k->times) {
+			fprintf(stderr, "Out of memory allocating wakeup storms\n");
+			exit(EXIT_FAILURE);
+		}
+		k->storm = -1;
+	}
+
+	/* Time going backwards, such as a reboot, starts the window again */
+	if (k->n && (t < k->times[(k->head + k->n - 1) % opt_storm_count])) {
+		k->n = 0;
+		k->storm = -1;
+	}
+	if (k->n == opt_storm_count) {
+		k->head = (k->head + 1) % opt_storm_count;
+		k->n--;
+	}
+	k->times[(k->head + k->n) % opt_storm_count] = t;
+	k->n++;
+
+	if ((k->n < opt_storm_count) || (t - k->times[k->head] > opt_storm_window)) {
+		k->storm = -1;
+		return;
+	}
+	if (k->storm < 0) {
+		storm_t *storm;
+
+		if (klog->nstorms == klog->storms_size) {
+			const uint32_t size = klog->storms_size ? klog->storms_size * 2 : 16;
+			storm_t *storms = realloc(klog->storms, sizeof(*storms) * size);
+
+			if (!storms) {
+				fprintf(stderr, "Out of memory allocating wakeup storms\n");
+				exit(EXIT_FAILURE);
+			}
+			klog->storms = storms;
+			klog->storms_size = size;
+		}
+		k->storm = (int)klog->nstorms++;
+		storm = &klog->storms[k->storm];
+		storm->key = key;
+		storm->start = k->times[k->head];
+		storm->end = t;
+		storm->count = opt_storm_count;
+		storm->wall = wall;
+	} else {
+		klog->storms[k->storm].end = t;
+		klog->storms[k->storm].count++;
+	}
+}
+
+/*
+ *  klog_storms_done()
+ *	add the wakeups of a finished suspend attempt to their sliding
+ *	windows at the time the attempt ended, on the same clock as the
+ *	suspend durations, -W
+ */
+static void klog_storms_done(klog_t *klog)
+{
+	const timestamp *start = &klog->suspend_start, *exit = &klog->suspend_exit;
+	const bool wall = start->pm_whence_valid || exit->pm_whence_valid;
+	double t;
+	uint32_t i;
+
+	if (exit->pm_whence_valid)
+		t = exit->pm_whence;
+	else if (start->pm_whence_valid)
+		t = start->pm_whence;
+	else if (exit->whence_valid)
+		t = exit->whence;
+	else if (start->whence_valid)
+		t = start->whence;
+	else
+		t = -1.0;
+
+	for (i = 0; (t >= 0.0) && (i < klog->storm_npending); i++)
+		klog_storm_add(klog, klog->storm_pending[i], t, wall);
+	klog->storm_npending = 0;
+}
+
+/*
+ *  klog_rule()
+ *	fire a rule, ptr is where its marker is in the line
+ */
+static void klog_rule(klog_t *klog, const rule_t *rule, char *buf, char *ptr)
+{
+	const char *name = rule->name;
+	char *arg = NULL;
+
+	if (ptr) {
+		arg = ptr + strnlen(ptr, (size_t)rule->offset);
+		if (rule->stop) {
+			char *end = arg + strcspn(arg, rule->stop);
+
+			if (*end) {
+				*end = '\0';
+				/* Markers past the argument are no longer in the line */
+				matches_truncate(&matcher, &klog->matches, strlen(buf));
+			}
+		}
+		if (!name)
+			name = arg;
+	}
+
+	klog->state &= ~rule->clear;
+	klog->state |= rule->set;
+	if (rule->also && match(&klog->matches, buf, rule->also_id))
+		klog->state |= rule->also_set;
+
+	switch (rule->action) {
+	case ACT_START:
+		klog_timestamp(klog, buf, &klog->suspend_start);
+		klog->suspend_duration_parsed = -1.0;
+		klog->device_phase = PHASE_SUSPEND;
+		break;
+	case ACT_PM_START:
+		parse_pm_timestamp(arg, &klog->suspend_start);
+		klog->suspend_duration_parsed = -1.0;
+		klog->device_phase = PHASE_SUSPEND;
+		break;
+	case ACT_PM_EXIT:
+		parse_pm_timestamp(arg, &klog->suspend_exit);
+		break;
+	case ACT_EXIT:
+		klog_timestamp(klog, buf, &klog->suspend_exit);
+		break;
+	case ACT_FAIL_CAUSE:
+		/* Pick first failure cause up, ignore rest */
+		if (klog->suspend_fail_cause >= 0)
+			return;
+		klog->suspend_fail_cause = (int)strtab_intern(&klog->names, name);
+		break;
+	case ACT_RESUME_CAUSE:
+		klog_cause_add(klog, arg);
+		break;
+	case ACT_SUSPENDED_FOR:
+		klog->suspend_duration_parsed = atof(arg);
+		klog->needs_config_suspend_time = false;
+		break;
+	case ACT_WAKELOCK:
+		if (!*arg)
+			return;
+		strncpy(klog->wakelock, arg, sizeof(klog->wakelock) - 1);
+		klog->wakelock[sizeof(klog->wakelock) - 1] = '\0';
+		name = klog->wakelock;
+		break;
+	case ACT_SUSPEND_DONE:
+		if (klog->storm_npending)
+			klog_storms_done(klog);
+		klog_suspend_done(klog);
+		if (opt_flags & OPT_PHASES)
+			klog_phases_done(klog);
+		return;
+	case ACT_PHASE_TIME: {
+		const int phase = phase_find(name);
+		const double v = phase_seconds(arg);
+
+		if (phase < 0)
+			return;
+		/* Device callbacks that follow are in the next phase */
+		klog->device_phase = ((phase < PHASE_SUSPEND) || (phase >= PHASE_RESUME)) ?
+			PHASE_SUSPEND : phase + 1;
+		if ((opt_flags & OPT_PHASES) && (v >= 0.0)) {
+			klog->phase_times[phase] += v;
+			klog->phase_seen |= 1U << phase;
+		}
+		return;
+	}
+	case ACT_CALLBACK:
+		if (opt_flags & OPT_CALLBACKS)
+			klog_callback(klog, buf, ptr, arg);
+		return;
+	default:
+		break;
+	}
+
+	if (rule->counter && name && *name &&
+	    (((opt_flags & counter_opts[rule->counter]) == counter_opts[rule->counter]) ||
+	     (opt_flags & OPT_SAVE_INDEX)))
+		counter_increment(name, klog_counter(klog, rule->counter));
+	if ((opt_flags & OPT_STORMS) && name && *name &&
+	    ((rule->counter == COUNTER_RESUME_CAUSES) ||
+	     (rule->counter == COUNTER_WAKEUP_SOURCES)))
+		klog_storm_pending(klog, name, rule->counter == COUNTER_WAKEUP_SOURCES);
+}
+
+/*
+ *  klog_event()
+ *	run the suspend state machine on a line that has markers in
+ *	it, the rules are tried in order until one ends the line
+ */
+static void klog_event(klog_t *klog, char *buf)
+{
+	int group = 0;
+	size_t i;
+
+	for (i = 0; i < nrules; i++) {
+		const rule_t *rule = &rules[i];
+		char *ptr = NULL;
+
+		if (rule->group && (rule->group == group))
+			continue;
+		if (rule->pattern &&
+		    ((ptr = match(&klog->matches, buf, rule->id)) == NULL))
+			continue;
+		if ((klog->state & rule->need) != rule->need)
+			continue;
+
+		group = rule->group;
+		klog_rule(klog, rule, buf, ptr);
+		if (rule->last)
+			return;
+	}
+}
+
+/*
+ *  line_find()
+ *	find str in a line that is not '\0' terminated
+ */
+static const char *line_find(const char *line, const size_t len, const char *str, const size_t n)
+{
+	const char *end = line + len;
+	const char *ptr;
+
+	for (ptr = line; (size_t)(end - ptr) >= n; ptr++) {
+		if (!(ptr = memchr(ptr, *str, (size_t)(end - ptr) - n + 1)))
+			return NULL;
+		if (!memcmp(ptr, str, n))
+			return ptr;
+	}
+	return NULL;
+}
+
+/*
+ *  klog_line_time()
+ *	wall clock time of a kernel log line from its syslog prefix or
+ *	its PM suspend entry or exit time stamp, syslog prefixes have no
+ *	year so it is taken to be year. Returns false if the line has no
+ *	wall clock time.
+ */
+static bool klog_line_time(const char *line, const size_t len, const int year, double *t)
+{
+	static const char months[] = "JanFebMarAprMayJunJulAugSepOctNovDec";
+	static const char *markers[] = { "PM: suspend entry ", "PM: suspend exit " };
+	const char *month;
+	int mday, hour, min, sec;
+	size_t i;
+
+	/* Syslog prefix, "Aug 18 12:10:22 " */
+	if ((len > 16) && (line[3] == ' ') && (line[6] == ' ') && (line[15] == ' ') &&
+	    ((month = line_find(months, sizeof(months) - 1, line, 3)) != NULL) &&
+	    ((month - months) % 3 == 0) &&
+	    (parse_digits(line + 4 + (line[4] == ' '), 2 - (line[4] == ' '), &mday) == line + 6) &&
+	    (parse_digits(line + 7, 2, &hour) == line + 9) && (line[9] == ':') &&
+	    (parse_digits(line + 10, 2, &min) == line + 12) && (line[12] == ':') &&
+	    (parse_digits(line + 13, 2, &sec) == line + 15)) {
+		struct tm tm;
+
+		memset(&tm, 0, sizeof(tm));
+		tm.tm_year = year - 1900;
+		tm.tm_mon = (int)(month - months) / 3;
+		tm.tm_mday = mday;
+		tm.tm_hour = hour;
+		tm.tm_min = min;
+		tm.tm_sec = sec;
+		*t = (double)mktime(&tm);
+		return true;
+	}
+
+	for (i = 0; i < sizeof(markers) / sizeof(markers[0]); i++) {
+		const size_t mlen = strlen(markers[i]);
+		const char *ptr = line_find(line, len, markers[i], mlen);
+
+		if (ptr) {
+			char buf[64];
+			timestamp ts;
+			size_t n;
+
+			/* Lines of a mapped kernel log are not '\0' terminated */
+			ptr += mlen;
+			n = (size_t)(line + len - ptr);
+			if (n >= sizeof(buf))
+				n = sizeof(buf) - 1;
+			memcpy(buf, ptr, n);
+			buf[n] = '\0';
+			parse_pm_timestamp(buf, &ts);
+			*t = ts.pm_whence;
+			return ts.pm_whence_valid;
+		}
+	}
+	return false;
+}
+
+/*
+ *  klog_results_reset()
+ *	forget what was found in the warm up before a -t window, the
+ *	suspend state machine carries on from where the warm up left it
+ */
+static void klog_results_reset(klog_t *klog)
+{
+	int i;
+
+	klog->suspend_list.n = 0;
+	klog->suspend_duration_list.n = 0;
+	memset(&klog->interval_sketch, 0, sizeof(klog->interval_sketch));
+	memset(&klog->suspend_sketch, 0, sizeof(klog->suspend_sketch));
+	histograms_free(&klog->histograms);
+	phases_reset(klog);
+	callbacks_free(klog);
+	storms_free(klog);
+	for (i = COUNTER_NONE + 1; i < COUNTER_MAX; i++)
+		counter_free(klog_counter(klog, i));
+	klog->suspend_succeeded = 0;
+	klog->suspend_failed = 0;
+	klog->kmsg_lost = 0;
+}
+
+/*
+ *  klog_window()
+ *	track the -t and -u time window, lines before -t time warm up
+ *	the suspend state machine, returns false once past -u time
+ */
+static bool klog_window(klog_t *klog, const char *line, const size_t len)
+{
+	double t;
+
+	if (klog->window_done)
+		return false;
+	if (klog->warmup &&
+	    klog_line_time(line, len, opt_since_year, &t) && (t >= opt_since)) {
+		klog_results_reset(klog);
+		klog->warmup = false;
+	}
+	if ((opt_flags & OPT_UNTIL) &&
+	    klog_line_time(line, len, opt_until_year, &t) && (t > opt_until)) {
+		klog->window_done = true;
+		return false;
+	}
+	return true;
+}
+
+/*
+ *  klog_seek()
+ *	binary search a mapped kernel log for times around t. All the
+ *	lines with a time before *lo are before t (or at t if inclusive)
+ *	and all the lines from *hi on are after it, lines between *lo and
+ *	*hi have to be parsed to find out. Times are assumed to not go
+ *	backwards.
+ */
+static void klog_seek(
+	const char *map,
+	const char *end,
+	const double t,
+	const int year,
+	const bool inclusive,
+	const char **lo,
+	const char **hi)
+{
+	*lo = map;
+	*hi = end;
+
+	while (*hi - *lo > WINDOW_LOOKBACK) {
+		const char *ptr = memchr(*lo + (*hi - *lo) / 2, '\n', (size_t)(*hi - *lo) / 2);
+		double lt = 0.0;
+
+		/* Find the first line with a time from halfway on */
+		while (ptr && (++ptr < *hi)) {
+			const char *eol = memchr(ptr, '\n', (size_t)(*hi - ptr));
+			const size_t len = (size_t)((eol ? eol : *hi) - ptr);
+
+			if (klog_line_time(ptr, len, year, &lt))
+				break;
+			ptr = eol;
+		}
+		if (!ptr || (ptr >= *hi))
+			break;
+
+		if (inclusive ? !(lt > t) : (lt < t)) {
+			const char *eol = memchr(ptr, '\n', (size_t)(*hi - ptr));
+
+			*lo = eol ? eol + 1 : *hi;
+		} else {
+			*hi = ptr;
+		}
+	}
+}
+
+/*
+ *  klog_text()
+ *	parse a line of len bytes, the line does not need to be
+ *	'\0' terminated and is never modified
+ */
+static void klog_text(klog_t *klog, const char *line, const size_t len)
+{
+	matcher_scan(&matcher, &klog->matches, line, len);
+	if (!klog->matches.hits)
+		return;
+	if ((opt_flags & (OPT_SINCE | OPT_UNTIL)) && !klog_window(klog, line, len))
+		return;
+
+	/*
+	 *  Only the few lines with markers in them get copied, the
+	 *  state machine needs a '\0' terminated line it can modify
+	 */
+	if (len >= klog->buf_size) {
+		char *buf;
+		size_t size = klog->buf_size ? klog->buf_size : 4096;
+
+		while (size <= len)
+			size += size;
+		buf = realloc(klog->buf, size);
+		if (!buf) {
+			fprintf(stderr, "Out of memory allocating line buffer\n");
+			exit(EXIT_FAILURE);
+		}
+		klog->buf = buf;
+		klog->buf_size = size;
+	}
+	memcpy(klog->buf, line, len);
+	klog->buf[len] = '\0';
+
+	/* An embedded '\0' ends the line as far as the state machine sees it */
+	if (memchr(line, '\0', len))
+		matches_truncate(&matcher, &klog->matches, strlen(klog->buf));
+
+	klog_event(klog, klog->buf);
+}
+
+/*
+ *  kmsg_field()
+ *	parse a decimal field of a /dev/kmsg record header, returns
+ *	the start of the next field or NULL if the header is malformed
+ */
+static const char *kmsg_field(const char *ptr, const char *end, uint64_t *val)
+{
+	const char *start = ptr;
+
+	*val = 0;
+	while ((ptr < end) && (*ptr >= '0') && (*ptr <= '9'))
+		*val = (*val * 10) + (uint64_t)(*ptr++ - '0');
+	if ((ptr == start) || (ptr == end))
+		return NULL;
+	if ((*ptr != ',') && (*ptr != ';'))
+		return NULL;
+
+	return ptr + 1;
+}
+
+/*
+ *  klog_kmsg_record()
+ *	parse a "prio,seq,usec,flags[,...];message" /dev/kmsg record, the
+ *	sequence number shows records lost to ring buffer overruns and
+ *	the timestamp is the exact monotonic time in microseconds
+ */
+static void klog_kmsg_record(klog_t *klog, const char *line, const size_t len)
+{
+	const char *ptr, *end = line + len, *msg;
+	uint64_t prio, seq, usec;
+
+	/* Continuation lines hold the record's " KEY=value" dictionary */
+	if (!len || (*line == ' '))
+		return;
+	if ((msg = memchr(line, ';', len)) == NULL)
+		return;
+
+	if ((ptr = kmsg_field(line, msg + 1, &prio)) == NULL)
+		return;
+	if ((ptr = kmsg_field(ptr, msg + 1, &seq)) == NULL)
+		return;
+	if (kmsg_field(ptr, msg + 1, &usec) == NULL)
+		return;
+
+	if (klog->kmsg_seq_valid && (seq > klog->kmsg_seq))
+		klog->kmsg_lost += seq - klog->kmsg_seq;
+	klog->kmsg_seq = seq + 1;
+	klog->kmsg_seq_valid = true;
+	klog->kmsg_usec = usec;
+
+	msg++;
+	klog_text(klog, msg, (size_t)(end - msg));
+}
+
+/*
+ *  klog_line()
+ *	parse a line of kernel log text or a /dev/kmsg record
+ */
+static void klog_line(klog_t *klog, const char *line, const size_t len)
+{
+	if (klog->kmsg)
+		klog_kmsg_record(klog, line, len);
+	else
+		klog_text(klog, line, len);
+}
+
+/*
+ *  klog_read_stream()
+ *	parse a kernel log line by line from a stream
+ */
+static void klog_read_stream(klog_t *klog, FILE *fp)
+{
+	char buf[4096];
+
+	while (fgets(buf, sizeof(buf), fp) != NULL) {
+		size_t len = strlen(buf);
+
+		if (len && (buf[len - 1] == '\n'))
+			buf[--len] = '\0';
+
+		klog_line(klog, buf, len);
+	}
+}
+
+/*
+ *  klog_chunk_scan()
+ *	thread to find the lines with markers in them in a chunk of
+ *	a mapped kernel log
+ */
+static void *klog_chunk_scan(void *arg)
+{
+	klog_chunk_t *chunk = (klog_chunk_t *)arg;
+	const char *ptr;
+
+	for (ptr = chunk->start; ptr < chunk->end; ) {
+		const char *eol = memchr(ptr, '\n', (size_t)(chunk->end - ptr));
+		size_t len;
+
+		if (!eol)
+			eol = chunk->end;
+		len = (size_t)(eol - ptr);
+
+		matcher_scan(&matcher, &chunk->matches, ptr, len);
+		if (chunk->matches.hits) {
+			if (chunk->nhits >= chunk->hits_size) {
+				klog_hit_t *hits;
+				size_t size = chunk->hits_size ? chunk->hits_size * 2 : 1024;
+
+				hits = realloc(chunk->hits, size * sizeof(*hits));
+				if (!hits) {
+					fprintf(stderr, "Out of memory allocating chunk hits\n");
+					exit(EXIT_FAILURE);
+				}
+				chunk->hits = hits;
+				chunk->hits_size = size;
+			}
+			chunk->hits[chunk->nhits].line = ptr;
+			chunk->hits[chunk->nhits].len = len;
+			chunk->nhits++;
+		}
+		ptr = eol + 1;
+	}
+	return NULL;
+}
+
+/*
+ *  klog_parse_parallel()
+ *	split a mapped kernel log at line boundaries into chunks and
+ *	scan the chunks concurrently. Almost all the time is spent
+ *	scanning lines that have no markers at all; the lines that do
+ *	are then replayed through the state machine in log order so
+ *	the suspend state carried between chunks is exactly that of a
+ *	serial parse.
+ */
+static void klog_parse_parallel(
+	klog_t *klog,
+	const char *map,
+	const size_t size,
+	const int threads)
+{
+	klog_chunk_t *chunks;
+	const char *ptr = map, *end = map + size;
+	size_t i, j, n = (size_t)threads;
+
+	if (n > size / CHUNK_MIN_SIZE)
+		n = size / CHUNK_MIN_SIZE;
+	if (n < 1)
+		n = 1;
+
+	chunks = calloc(n, sizeof(*chunks));
+	if (!chunks) {
+		fprintf(stderr, "Out of memory allocating chunks\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (i = 0; i < n; i++) {
+		const char *chunk_end = map + (size / n) * (i + 1);
+
+		if ((i == n - 1) || (chunk_end >= end)) {
+			chunk_end = end;
+		} else {
+			chunk_end = memchr(chunk_end, '\n', (size_t)(end - chunk_end));
+			chunk_end = chunk_end ? chunk_end + 1 : end;
+		}
+		chunks[i].start = ptr;
+		chunks[i].end = chunk_end;
+		matches_init(&chunks[i].matches, &matcher);
+		ptr = chunk_end;
+	}
+
+	/* Chunk 0 is scanned by this thread */
+	for (i = 1; i < n; i++) {
+		chunks[i].threaded = (pthread_create(&chunks[i].thread, NULL,
+			klog_chunk_scan, &chunks[i]) == 0);
+		if (!chunks[i].threaded)
+			(void)klog_chunk_scan(&chunks[i]);
+	}
+	(void)klog_chunk_scan(&chunks[0]);
+
+	for (i = 0; i < n; i++) {
+		if (chunks[i].threaded)
+			(void)pthread_join(chunks[i].thread, NULL);
+		for (j = 0; j < chunks[i].nhits; j++)
+			klog_line(klog, chunks[i].hits[j].line, chunks[i].hits[j].len);
+		matches_free(&chunks[i].matches);
+		free(chunks[i].hits);
+	}
+	free(chunks);
+}
+
+/*
+ *  klog_partial_add()
+ *	append text to the partial line carried between blocks
+ */
+static void klog_partial_add(klog_t *klog, const char *text, const size_t len)
+{
+	if (klog->partial_len + len >= klog->partial_size) {
+		char *partial;
+		size_t size = klog->partial_size ? klog->partial_size : 4096;
+
+		while (size <= klog->partial_len + len)
+			size += size;
+		partial = realloc(klog->partial, size);
+		if (!partial) {
+			fprintf(stderr, "Out of memory allocating line buffer\n");
+			exit(EXIT_FAILURE);
+		}
+		klog->partial = partial;
+		klog->partial_size = size;
+	}
+	memcpy(klog->partial + klog->partial_len, text, len);
+	klog->partial_len += len;
+}
+
+/*
+ *  klog_parse_block()
+ *	parse a block of kernel log text, a line may span blocks
+ *	so any trailing partial line is carried over to the next block
+ */
+static void klog_parse_block(klog_t *klog, const char *data, const size_t len)
+{
+	const char *ptr = data, *end = data + len;
+
+	while (ptr < end) {
+		const char *eol = memchr(ptr, '\n', (size_t)(end - ptr));
+
+		if (!eol) {
+			klog_partial_add(klog, ptr, (size_t)(end - ptr));
+			break;
+		}
+		if (klog->partial_len) {
+			klog_partial_add(klog, ptr, (size_t)(eol - ptr));
+			klog_line(klog, klog->partial, klog->partial_len);
+			klog->partial_len = 0;
+		} else {
+			klog_line(klog, ptr, (size_t)(eol - ptr));
+		}
+		ptr = eol + 1;
+	}
+}
+
+/*
+ *  klog_parse_flush()
+ *	parse any partial last line that was not '\n' terminated
+ */
+static void klog_parse_flush(klog_t *klog)
+{
+	if (klog->partial_len) {
+		klog_line(klog, klog->partial, klog->partial_len);
+		klog->partial_len = 0;
+	}
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_LZMA) || defined(HAVE_ZSTD)
+/*
+ *  klog_queue_get()
+ *	get a free block for the decompressor to fill, blocks
+ *	until the parser has released one
+ */
+static char *klog_queue_get(klog_queue_t *q)
+{
+	char *data;
+
+	(void)pthread_mutex_lock(&q->lock);
+	while (q->count == DECOMP_BLOCKS)
+		(void)pthread_cond_wait(&q->cond, &q->lock);
+	data = q->blocks[(q->head + q->count) % DECOMP_BLOCKS].data;
+	(void)pthread_mutex_unlock(&q->lock);
+
+	return data;
+}
+
+/*
+ *  klog_queue_put()
+ *	hand a block of len bytes of decompressed text to the parser
+ */
+static void klog_queue_put(klog_queue_t *q, const size_t len)
+{
+	(void)pthread_mutex_lock(&q->lock);
+	q->blocks[(q->head + q->count) % DECOMP_BLOCKS].len = len;
+	q->count++;
+	(void)pthread_cond_broadcast(&q->cond);
+	(void)pthread_mutex_unlock(&q->lock);
+}
+
+/*
+ *  klog_queue_next()
+ *	get the next block of decompressed text to parse,
+ *	returns NULL when the decompressor has finished
+ */
+static klog_block_t *klog_queue_next(klog_queue_t *q)
+{
+	klog_block_t *block = NULL;
+
+	(void)pthread_mutex_lock(&q->lock);
+	while (!q->count && !q->done)
+		(void)pthread_cond_wait(&q->cond, &q->lock);
+	if (q->count)
+		block = &q->blocks[q->head];
+	(void)pthread_mutex_unlock(&q->lock);
+
+	return block;
+}
+
+/*
+ *  klog_queue_release()
+ *	give the block returned by klog_queue_next() back to the
+ *	decompressor
+ */
+static void klog_queue_release(klog_queue_t *q)
+{
+	(void)pthread_mutex_lock(&q->lock);
+	q->head = (q->head + 1) % DECOMP_BLOCKS;
+	q->count--;
+	(void)pthread_cond_broadcast(&q->cond);
+	(void)pthread_mutex_unlock(&q->lock);
+}
+#endif
+
+#if defined(HAVE_ZLIB)
+/*
+ *  decompress_gzip()
+ *	decompress gzip data, including multiple concatenated members
+ */
+static int decompress_gzip(const uint8_t *in, const size_t len, klog_queue_t *q)
+{
+	z_stream z;
+	size_t remaining = len;
+	int ret;
+
+	memset(&z, 0, sizeof(z));
+	/* 32 enables gzip and zlib header detection */
+	if (inflateInit2(&z, 15 + 32) != Z_OK) {
+		q->error = "cannot initialize zlib";
+		return -1;
+	}
+	z.next_in = in;
+
+	for (;;) {
+		size_t n;
+
+		if (!z.avail_in && remaining) {
+			n = (remaining > UINT_MAX) ? UINT_MAX : remaining;
+			z.avail_in = (uInt)n;
+			remaining -= n;
+		}
+		z.next_out = (Bytef *)klog_queue_get(q);
+		z.avail_out = DECOMP_BLOCK_SIZE;
+
+		ret = inflate(&z, Z_NO_FLUSH);
+		if ((n = DECOMP_BLOCK_SIZE - z.avail_out) > 0)
+			klog_queue_put(q, n);
+
+		if (ret == Z_STREAM_END) {
+			if (!z.avail_in && !remaining)
+				break;
+			/* Another gzip member follows */
+			if ((ret = inflateReset(&z)) != Z_OK)
+				break;
+		} else if (ret != Z_OK) {
+			break;
+		}
+	}
+	(void)inflateEnd(&z);
+
+	if (ret != Z_STREAM_END) {
+		q->error = "corrupt or truncated gzip data";
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+#if defined(HAVE_LZMA)
+/*
+ *  decompress_xz()
+ *	decompress xz data, including multiple concatenated streams
+ */
+static int decompress_xz(const uint8_t *in, const size_t len, klog_queue_t *q)
+{
+	lzma_stream strm = LZMA_STREAM_INIT;
+	lzma_ret ret;
+
+	if (lzma_stream_decoder(&strm, UINT64_MAX, LZMA_CONCATENATED) != LZMA_OK) {
+		q->error = "cannot initialize lzma";
+		return -1;
+	}
+	strm.next_in = in;
+	strm.avail_in = len;
+
+	do {
+		strm.next_out = (uint8_t *)klog_queue_get(q);
+		strm.avail_out = DECOMP_BLOCK_SIZE;
+
+		ret = lzma_code(&strm, LZMA_FINISH);
+		klog_queue_put(q, DECOMP_BLOCK_SIZE - strm.avail_out);
+	} while (ret == LZMA_OK);
+	lzma_end(&strm);
+
+	if (ret != LZMA_STREAM_END) {
+		q->error = "corrupt or truncated xz data";
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+#if defined(HAVE_ZSTD)
+/*
+ *  decompress_zstd()
+ *	decompress zstd data, including multiple concatenated frames
+ */
+static int decompress_zstd(const uint8_t *in, const size_t len, klog_queue_t *q)
+{
+	ZSTD_DStream *zds;
+	ZSTD_inBuffer input = { in, len, 0 };
+	size_t ret = 0;
+
+	if ((zds = ZSTD_createDStream()) == NULL) {
+		q->error = "cannot initialize zstd";
+		return -1;
+	}
+	(void)ZSTD_initDStream(zds);
+
+	while (input.pos < input.size) {
+		ZSTD_outBuffer output;
+
+		output.dst = klog_queue_get(q);
+		output.size = DECOMP_BLOCK_SIZE;
+		output.pos = 0;
+
+		ret = ZSTD_decompressStream(zds, &output, &input);
+		if (ZSTD_isError(ret))
+			break;
+		klog_queue_put(q, output.pos);
+	}
+	(void)ZSTD_freeDStream(zds);
+
+	/* A non-zero hint at the end of the input means a truncated frame */
+	if (ZSTD_isError(ret) || ret) {
+		q->error = "corrupt or truncated zstd data";
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+/*
+ *  Compressed kernel log formats, identified by their magic bytes
+ */
+static const decompressor_t decompressors[] = {
+	{ "gzip", { 0x1f, 0x8b }, 2,
+#if defined(HAVE_ZLIB)
+	  decompress_gzip },
+#else
+	  NULL },
+#endif
+	{ "xz",   { 0xfd, '7', 'z', 'X', 'Z', 0x00 }, 6,
+#if defined(HAVE_LZMA)
+	  decompress_xz },
+#else
+	  NULL },
+#endif
+	{ "zstd", { 0x28, 0xb5, 0x2f, 0xfd }, 4,
+#if defined(HAVE_ZSTD)
+	  decompress_zstd },
+#else
+	  NULL },
+#endif
+};
+
+/*
+ *  decompressor_find()
+ *	find the decompressor for data, NULL if it is not compressed
+ */
+static const decompressor_t *decompressor_find(const uint8_t *data, const size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < sizeof(decompressors) / sizeof(decompressors[0]); i++) {
+		const decompressor_t *d = &decompressors[i];
+
+		if ((len >= d->magic_len) && !memcmp(data, d->magic, d->magic_len))
+			return d;
+	}
+	return NULL;
+}
+
+#if defined(HAVE_ZLIB) || defined(HAVE_LZMA) || defined(HAVE_ZSTD)
+/*
+ *  klog_decompress_thread()
+ *	thread to decompress a kernel log into the block queue
+ */
+static void *klog_decompress_thread(void *arg)
+{
+	klog_queue_t *q = (klog_queue_t *)arg;
+
+	(void)q->decompressor->decompress(q->in, q->in_len, q);
+
+	(void)pthread_mutex_lock(&q->lock);
+	q->done = true;
+	(void)pthread_cond_broadcast(&q->cond);
+	(void)pthread_mutex_unlock(&q->lock);
+
+	return NULL;
+}
+
+/*
+ *  klog_read_compressed()
+ *	parse a compressed kernel log, decompression runs on a
+ *	second thread so it overlaps with parsing
+ */
+static void klog_read_compressed(
+	klog_t *klog,
+	const decompressor_t *d,
+	const uint8_t *in,
+	const size_t len)
+{
+	klog_queue_t q;
+	klog_block_t *block;
+	pthread_t thread;
+	int i;
+
+	if (!d->decompress) {
+		fprintf(stderr, "Cannot parse %s, %s support is not built in.\n",
+			klog->filename, d->name);
+		return;
+	}
+
+	memset(&q, 0, sizeof(q));
+	q.decompressor = d;
+	q.in = in;
+	q.in_len = len;
+	for (i = 0; i < DECOMP_BLOCKS; i++) {
+		if ((q.blocks[i].data = malloc(DECOMP_BLOCK_SIZE)) == NULL) {
+			fprintf(stderr, "Out of memory allocating decompression buffers\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	(void)pthread_mutex_init(&q.lock, NULL);
+	(void)pthread_cond_init(&q.cond, NULL);
+
+	if (pthread_create(&thread, NULL, klog_decompress_thread, &q) != 0) {
+		fprintf(stderr, "Cannot create decompression thread: errno=%d (%s)\n",
+			errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	while ((block = klog_queue_next(&q)) != NULL) {
+		klog_parse_block(klog, block->data, block->len);
+		klog_queue_release(&q);
+	}
+	klog_parse_flush(klog);
+	(void)pthread_join(thread, NULL);
+
+	if (q.error)
+		fprintf(stderr, "Cannot decompress all of %s, %s.\n",
+			klog->filename, q.error);
+
+	(void)pthread_cond_destroy(&q.cond);
+	(void)pthread_mutex_destroy(&q.lock);
+	for (i = 0; i < DECOMP_BLOCKS; i++)
+		free(q.blocks[i].data);
+}
+#else
+/*
+ *  klog_read_compressed()
+ *	no decompressors are built in, so compressed kernel logs
+ *	cannot be parsed
+ */
+static void klog_read_compressed(
+	klog_t *klog,
+	const decompressor_t *d,
+	const uint8_t *in,
+	const size_t len)
+{
+	(void)in;
+	(void)len;
+
+	fprintf(stderr, "Cannot parse %s, %s support is not built in.\n",
+		klog->filename, d->name);
+}
+#endif
+
+/*
+ *  klog_read_mmap()
+ *	parse a kernel log by walking a read-only mapping of the
+ *	file in place using up to threads threads, compressed logs
+ *	are decompressed from the mapping, returns -1 if the file
+ *	cannot be mapped
+ */
+static int klog_read_mmap(klog_t *klog, const int fd, const int threads)
+{
+	struct stat statbuf;
+	void *addr;
+	const char *map, *ptr, *end;
+	const decompressor_t *decompressor;
+
+	if (fstat(fd, &statbuf) < 0)
+		return -1;
+	/* Pipes, ttys and /proc files have to be read as a stream */
+	if (!S_ISREG(statbuf.st_mode) || (statbuf.st_size <= 0))
+		return -1;
+
+	addr = mmap(NULL, (size_t)statbuf.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (addr == MAP_FAILED)
+		return -1;
+	(void)madvise(addr, (size_t)statbuf.st_size, MADV_SEQUENTIAL);
+	map = addr;
+
+	decompressor = decompressor_find((const uint8_t *)map, (size_t)statbuf.st_size);
+	if (decompressor) {
+		klog_read_compressed(klog, decompressor,
+			(const uint8_t *)map, (size_t)statbuf.st_size);
+	} else {
+		const char *start = map, *lo, *hi;
+
+		end = map + statbuf.st_size;
+		/*
+		 *  Only parse the -t and -u time window of the log and a
+		 *  warm up before it, kmsg dumps are parsed in full so
+		 *  every sequence number is seen
+		 */
+		if ((opt_flags & OPT_SINCE) && !klog->kmsg) {
+			klog_seek(map, end, opt_since, opt_since_year, false, &lo, &hi);
+			if (lo - map > WINDOW_LOOKBACK) {
+				start = memchr(lo - WINDOW_LOOKBACK, '\n',
+					(size_t)(end - (lo - WINDOW_LOOKBACK)));
+				start = start ? start + 1 : end;
+			}
+		}
+		if ((opt_flags & OPT_UNTIL) && !klog->kmsg) {
+			klog_seek(start, end, opt_until, opt_until_year, true, &lo, &hi);
+			end = hi;
+		}
+		if ((threads > 1) && !klog->kmsg) {
+			klog_parse_parallel(klog, start, (size_t)(end - start), threads);
+		} else {
+			for (ptr = start; ptr < end; ) {
+				const char *eol = memchr(ptr, '\n', (size_t)(end - ptr));
+
+				if (!eol)
+					eol = end;
+				klog_line(klog, ptr, (size_t)(eol - ptr));
+				ptr = eol + 1;
+			}
+		}
+	}
+	(void)munmap(addr, (size_t)statbuf.st_size);
+
+	return 0;
+}
+
+/*
+ *  klog_read_fd()
+ *	parse everything that can be read from fd without blocking,
+ *	/dev/kmsg returns one record per read and fails with EPIPE
+ *	when records were overwritten before they could be read
+ */
+static void klog_read_fd(klog_t *klog, const int fd, char *buf)
+{
+	for (;;) {
+		ssize_t n = read(fd, buf, FOLLOW_BUF_SIZE);
+
+		if (n > 0)
+			klog_parse_block(klog, buf, (size_t)n);
+		else if ((n < 0) && ((errno == EPIPE) || (errno == EINTR)) && keep_running)
+			continue;
+		else
+			break;
+	}
+}
+
+/*
+ *  klog_read_kmsg()
+ *	read the records currently held in the kernel ring buffer
+ *	from /dev/kmsg, returns -1 if fd is not a /dev/kmsg device
+ */
+static int klog_read_kmsg(klog_t *klog, const int fd)
+{
+	struct stat statbuf;
+	char *buf;
+	int flags;
+
+	if (!klog->kmsg || (fstat(fd, &statbuf) < 0) || !S_ISCHR(statbuf.st_mode))
+		return -1;
+	/* Reads would block at the end of the ring buffer */
+	if (((flags = fcntl(fd, F_GETFL)) < 0) ||
+	    (fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0))
+		return -1;
+	if ((buf = malloc(FOLLOW_BUF_SIZE)) == NULL) {
+		fprintf(stderr, "Out of memory allocating kmsg buffer\n");
+		exit(EXIT_FAILURE);
+	}
+	klog_read_fd(klog, fd, buf);
+	klog_parse_flush(klog);
+	free(buf);
+
+	return 0;
+}
+
+/*
+ *  phases_dump()
+ *	dump out the latency of each suspend and resume phase, -p
+ */
+static void phases_dump(const klog_t *klog, json_object *result)
+{
+	json_object *array = NULL, *item, *obj;
+	int i;
+
+	print("\nSuspend phase latency (ms):\n");
+	print("  Phase                 Count        Min       Mean        P99        Max\n");
+	if (result) {
+		if ((array = json_array()) == NULL)
+			return;
+		json_object_object_add(result, "suspend-phases", array);
+	}
+
+	for (i = 0; i < PHASE_MAX; i++) {
+		const sketch_t *sk = &klog->phases[i].sketch;
+		const double mean = sk->count ? sk->sum / (double)sk->count : 0.0;
+		const double p99 = sketch_quantile(sk, 0.99);
+
+		if (!sk->count)
+			continue;
+		print("  %-18s %8" PRIu64 " %10.3f %10.3f %10.3f %10.3f\n",
+			phase_names[i].text, sk->count, sk->min * 1000.0,
+			mean * 1000.0, p99 * 1000.0, sk->max * 1000.0);
+
+		if (!array)
+			continue;
+		if ((item = json_obj()) == NULL)
+			return;
+		json_object_array_add(array, item);
+		if ((obj = json_str(phase_names[i].name)) == NULL)
+			return;
+		json_object_object_add(item, "phase", obj);
+		if ((obj = json_object_new_int64((int64_t)sk->count)) == NULL)
+			return;
+		json_object_object_add(item, "count", obj);
+		if ((obj = json_double(sk->min)) == NULL)
+			return;
+		json_object_object_add(item, "minimum-seconds", obj);
+		if ((obj = json_double(mean)) == NULL)
+			return;
+		json_object_object_add(item, "mean-seconds", obj);
+		if ((obj = json_double(p99)) == NULL)
+			return;
+		json_object_object_add(item, "p99-seconds", obj);
+		if ((obj = json_double(sk->max)) == NULL)
+			return;
+		json_object_object_add(item, "maximum-seconds", obj);
+	}
+	if (opt_flags & OPT_HISTOGRAM) {
+		for (i = 0; i < PHASE_MAX; i++) {
+			const sketch_t *sk = &klog->phases[i].sketch;
+
+			if (!sk->count)
+				continue;
+			print("\n%s latency:\n", phase_names[i].text);
+			histogram_dump_precise(&klog->phases[i].histogram, sk->sum);
+		}
+	}
+}
+
+/*
+ *  callback_p99()
+ *	estimate the 99th percentile latency of a device callback, the
+ *	top of the bin of its nearest rank, as sketch_quantile(), so it
+ *	is never under and at most 9% over
+ */
+static double callback_p99(const callback_stat_t *stat)
+{
+	const uint32_t rank = (uint32_t)ceil(0.99 * (double)stat->count) - 1;
+	uint32_t n = 0;
+	int i;
+
+	for (i = 0; i < CALLBACK_BINS; i++) {
+		n += stat->bins[i];
+		if (n > rank) {
+			const double v = exp2((double)i / CALLBACK_BINS_PER_2) / 1000000.0;
+
+			return v < stat->max ? v : stat->max;
+		}
+	}
+	return stat->max;
+}
+
+static int callback_entry_cmp(const void *p1, const void *p2)
+{
+	const callback_entry *c1 = (const callback_entry *)p1;
+	const callback_entry *c2 = (const callback_entry *)p2;
+
+	if (c1->stat->total < c2->stat->total)
+		return 1;
+	if (c1->stat->total > c2->stat->total)
+		return -1;
+	if (c1->device != c2->device)
+		return c1->device < c2->device ? -1 : 1;
+	return c1->phase - c2->phase;
+}
+
+/*
+ *  callbacks_dump()
+ *	dump out the device callbacks that took longest in total
+ *	over the whole log for a phase, -c
+ */
+static void callbacks_dump(const klog_t *klog, json_object *result)
+{
+	json_object *array = NULL, *item, *obj;
+	callback_entry *sorted;
+	uint32_t i, n = 0;
+
+	sorted = calloc(klog->callbacks_size ? klog->callbacks_size : 1, sizeof(*sorted));
+	if (!sorted) {
+		fprintf(stderr, "Out of memory allocating sorted device callbacks\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < klog->callbacks_size; i++) {
+		if (!klog->callbacks[i].count)
+			continue;
+		sorted[n].device = i / PHASE_MAX;
+		sorted[n].phase = (int)(i % PHASE_MAX);
+		sorted[n++].stat = &klog->callbacks[i];
+	}
+	qsort(sorted, n, sizeof(*sorted), callback_entry_cmp);
+	if (n > (uint32_t)opt_callbacks)
+		n = (uint32_t)opt_callbacks;
+
+	print("\nSlowest device callbacks (ms):\n");
+	print("  %-24s %-13s %7s %10s %9s %9s %9s\n",
+		"Device", "Phase", "Count", "Total", "Mean", "P99", "Max");
+	if (!n)
+		print("  None\n");
+	if (result) {
+		if ((array = json_array()) == NULL)
+			goto out;
+		json_object_object_add(result, "device-callbacks", array);
+	}
+
+	for (i = 0; i < n; i++) {
+		const callback_stat_t *stat = sorted[i].stat;
+		const char *device = strtab_str(&klog->devices, sorted[i].device);
+		const char *phase = phase_names[sorted[i].phase].name;
+		const double mean = stat->total / (double)stat->count;
+		const double p99 = callback_p99(stat);
+
+		print("  %-24.24s %-13s %7" PRIu32 " %10.3f %9.3f %9.3f %9.3f\n",
+			device, phase, stat->count, stat->total * 1000.0,
+			mean * 1000.0, p99 * 1000.0, stat->max * 1000.0);
+
+		if (!array)
+			continue;
+		if ((item = json_obj()) == NULL)
+			break;
+		json_object_array_add(array, item);
+		if ((obj = json_str(device)) == NULL)
+			break;
+		json_object_object_add(item, "device", obj);
+		if ((obj = json_str(phase)) == NULL)
+			break;
+		json_object_object_add(item, "phase", obj);
+		if ((obj = json_int((int)stat->count)) == NULL)
+			break;
+		json_object_object_add(item, "count", obj);
+		if ((obj = json_double(stat->total)) == NULL)
+			break;
+		json_object_object_add(item, "total-seconds", obj);
+		if ((obj = json_double(mean)) == NULL)
+			break;
+		json_object_object_add(item, "mean-seconds", obj);
+		if ((obj = json_double(p99)) == NULL)
+			break;
+		json_object_object_add(item, "p99-seconds", obj);
+		if ((obj = json_double(stat->max)) == NULL)
+			break;
+		json_object_object_add(item, "maximum-seconds", obj);
+	}
+out:
+	free(sorted);
+}
+
+/*
+ *  storm_time_text()
+ *	text of a wakeup storm time, wall clock times as a date
+ */
+static void storm_time_text(char *buf, const size_t len, const double t, const bool wall)
+{
+	const time_t secs = (time_t)t;
+	struct tm tm;
+
+	if (wall && localtime_r(&secs, &tm))
+		(void)strftime(buf, len, "%Y-%m-%d %H:%M:%S", &tm);
+	else
+		(void)snprintf(buf, len, "%.6f", t);
+}
+
+/*
+ *  storms_dump()
+ *	dump out the wakeup storms in the order they started, -W
+ */
+static void storms_dump(const klog_t *klog, json_object *result)
+{
+	json_object *array = NULL, *item, *obj;
+	uint32_t i;
+
+	print("\nWakeup storms (%" PRIu32 " or more wakeups in %g seconds):\n",
+		opt_storm_count, opt_storm_window);
+	if (!klog->nstorms)
+		print("  None\n");
+	else
+		print("  %-19s  %-19s  %7s  %s\n", "Start", "End", "Wakeups", "Cause");
+	if (result) {
+		if ((array = json_array()) == NULL)
+			return;
+		json_object_object_add(result, "wakeup-storms", array);
+	}
+
+	for (i = 0; i < klog->nstorms; i++) {
+		const storm_t *storm = &klog->storms[i];
+		const char *name = strtab_str(&klog->names, storm->key / 2);
+		const char *kind = (storm->key & 1) ? "wakeup-source" : "resume-cause";
+		char start[32], end[32];
+
+		storm_time_text(start, sizeof(start), storm->start, storm->wall);
+		storm_time_text(end, sizeof(end), storm->end, storm->wall);
+		print("  %-19s  %-19s  %7" PRIu32 "  %s%s\n", start, end, storm->count,
+			name, (storm->key & 1) ? " (wakeup source)" : "");
+
+		if (!array)
+			continue;
+		if ((item = json_obj()) == NULL)
+			return;
+		json_object_array_add(array, item);
+		if ((obj = json_str(name)) == NULL)
+			return;
+		json_object_object_add(item, "cause", obj);
+		if ((obj = json_str(kind)) == NULL)
+			return;
+		json_object_object_add(item, "type", obj);
+		if ((obj = json_double(storm->start)) == NULL)
+			return;
+		json_object_object_add(item, "start-seconds", obj);
+		if ((obj = json_double(storm->end)) == NULL)
+			return;
+		json_object_object_add(item, "end-seconds", obj);
+		if ((obj = json_object_new_boolean(storm->wall)) == NULL)
+			return;
+		json_object_object_add(item, "wall-clock", obj);
+		if ((obj = json_int((int)storm->count)) == NULL)
+			return;
+		json_object_object_add(item, "wakeups", obj);
+	}
+}
+
+/*
+ *  Percentiles reported from the -S sketches
+ */
+static const percentile_t percentiles[] = {
+	{ 0.90,		"90th",		"p90" },
+	{ 0.99,		"99th",		"p99" },
+	{ 0.999,	"99.9th",	"p99.9" },
+};
+
+#define PERCENTILES	(sizeof(percentiles) / sizeof(percentiles[0]))
+
+/*
+ *  klog_report()
+ *	report the suspend statistics gathered from a kernel log
+ */
+static void klog_report(
+	klog_t *klog,
+	json_object *result,
+	const int opt_freq_min)
+{
+	int suspend_count;
+	size_t i;
+	double interval_mode, interval_median, suspend_mode, suspend_median;
+	double interval_mean, interval_min, interval_max, interval_sum, interval_percent;
+	double suspend_mean, suspend_min, suspend_max, suspend_sum, suspend_percent;
+	double total_percent;
+	double percent_succeeded, percent_failed;
+	json_object *obj;
+
+	/* Nothing in the log was at or after the -t time */
+	if (klog->warmup)
+		klog_results_reset(klog);
+
+	if (result) {
+		if ((obj = json_str(klog->filename)) == NULL)
+			return;
+		json_object_object_add(result, "kernel-log", obj);
+	}
+
+	if (opt_flags & OPT_VERBOSE)
+		fputc('\n', output());
+
+	if (klog->kmsg) {
+		if (klog->kmsg_lost)
+			print("%" PRIu64 " kernel log records were lost, "
+				"results may be incomplete.\n", klog->kmsg_lost);
+		if (result) {
+			if ((obj = json_object_new_int64((int64_t)klog->kmsg_lost)) == NULL)
+				return;
+			json_object_object_add(result, "kmsg-records-lost", obj);
+		}
+	}
+
+	suspend_count = klog->suspend_failed + klog->suspend_succeeded;
+
+	if (opt_flags & OPT_WAKELOCK_BLOCKERS) {
+		print("Suspend blocking wakelocks:\n");
+		counter_dump(&klog->wakelocks_count, "suspend-blocking-wakelocks", result);
+	}
+
+	if (opt_flags & OPT_RESUME_CAUSES) {
+		print("Resume wakeup causes:\n");
+		counter_dump(&klog->resume_causes, "resume-wakeups", result);
+		print("Suspend failure causes:\n");
+		counter_dump(&klog->suspend_fail_causes, "suspend-failures", result);
+		fprintf(output(), "Active wakeup sources:\n");
+		counter_dump(&klog->wakeup_sources, "wakeup-sources", result);
+	}
+
+	if (opt_flags & OPT_SKETCH) {
+		sketch_stats(&klog->interval_sketch, &interval_mode, &interval_median,
+			&interval_mean, &interval_min, &interval_max, &interval_sum);
+		sketch_stats(&klog->suspend_sketch, &suspend_mode, &suspend_median,
+			&suspend_mean, &suspend_min, &suspend_max, &suspend_sum);
+	} else {
+		time_calc_stats(&klog->suspend_list, &interval_mode, &interval_median,
+			&interval_mean, &interval_min, &interval_max, &interval_sum);
+		time_calc_stats(&klog->suspend_duration_list, &suspend_mode, &suspend_median,
+			&suspend_mean, &suspend_min, &suspend_max, &suspend_sum);
+	}
+
+	if (opt_flags & OPT_HISTOGRAM) {
+		histogram_dump(&klog->histograms.intervals, "Time between successful suspends:");
+		histogram_dump(&klog->histograms.durations, "Duration of successful suspends:");
+	}
+
+	print("Suspends:\n");
+	percent_failed = (suspend_count == 0) ?
+		0.0 : 100.0 * (double)klog->suspend_failed / suspend_count;
+	percent_succeeded = (suspend_count == 0) ?
+		0.0 : 100.0 * (double)klog->suspend_succeeded / suspend_count;
+	total_percent = interval_sum + suspend_sum;
+	suspend_percent = FLOAT_CMP(total_percent, 0.0) ?
+		0.0 : 100.0 * suspend_sum / total_percent;
+	interval_percent = FLOAT_CMP(total_percent, 0.0) ?
+		0.0 : 100.0 * interval_sum / total_percent;
+
+	print("  %d suspends aborted (%.2f%%).\n", klog->suspend_failed, percent_failed);
+	print("  %d suspends succeeded (%.2f%%).\n", klog->suspend_succeeded, percent_succeeded);
+	print("  total time: %f seconds (%.2f%%).\n", suspend_sum, suspend_percent);
+	print("  minimum: %f seconds.\n", suspend_min);
+	print("  maximum: %f seconds.\n", suspend_max);
+	print("  mean: %f seconds.\n", suspend_mean);
+	print("  mode: %f seconds.\n", suspend_mode);
+	print("  median: %f seconds.\n", suspend_median);
+	for (i = 0; (opt_flags & OPT_SKETCH) && (i < PERCENTILES); i++)
+		print("  %s percentile: %f seconds.\n", percentiles[i].text,
+			sketch_quantile(&klog->suspend_sketch, percentiles[i].q));
+
+	print("\nTime between successful suspends:\n");
+	print("  total time: %f seconds (%.2f%%).\n", interval_sum, interval_percent);
+	print("  minimum: %f seconds.\n", interval_min);
+	print("  maximum: %f seconds.\n", interval_max);
+	print("  mean: %f seconds.\n", interval_mean);
+	print("  mode: %f seconds.\n", interval_mode);
+	print("  median: %f seconds.\n", interval_median);
+	for (i = 0; (opt_flags & OPT_SKETCH) && (i < PERCENTILES); i++)
+		print("  %s percentile: %f seconds.\n", percentiles[i].text,
+			sketch_quantile(&klog->interval_sketch, percentiles[i].q));
+
+	if (opt_flags & OPT_SKETCH)
+		print("\nNOTE: medians and percentiles are estimates to within %.0f%%.\n",
+			100.0 * SKETCH_ALPHA);
+
+	if ((suspend_count > 0) && klog->needs_config_suspend_time) {
+		print("\nNOTE: suspend times are very dubious, enable kernel config setting\n");
+		print("      CONFIG_SUSPEND_TIME=y for accurate suspend times.\n");
+	}
+
+	if (opt_flags & OPT_FREQUENCY_REPORT) {
+		frequency_dump(klog, opt_freq_min);
+	}
+
+	if (klog->phases)
+		phases_dump(klog, result);
+
+	if (opt_flags & OPT_CALLBACKS)
+		callbacks_dump(klog, result);
+
+	if (opt_flags & OPT_STORMS)
+		storms_dump(klog, result);
+
+	if (result) {
+		/* suspend stats */
+		if ((obj = json_int(suspend_count)) == NULL)
+			return;
+		json_object_object_add(result, "suspends-attempted", obj);
+		if ((obj = json_int(klog->suspend_failed)) == NULL)
+			return;
+		json_object_object_add(result, "suspends-aborted", obj);
+		if ((obj = json_int(klog->suspend_succeeded)) == NULL)
+			return;
+		json_object_object_add(result, "suspends-succeeded", obj);
+
+		if ((obj = json_double(percent_failed)) == NULL)
+			return;
+		json_object_object_add(result, "suspends-aborted-percent", obj);
+		if ((obj = json_double(percent_succeeded)) == NULL)
+			return;
+		json_object_object_add(result, "suspends-succeeded-percent", obj);
+
+		if ((obj = json_double(suspend_sum)) == NULL)
+			return;
+		json_object_object_add(result, "suspends-total-time-seconds", obj);
+		if ((obj = json_double(suspend_percent)) == NULL)
+			return;
+		json_object_object_add(result, "suspends-total-time-percent", obj);
+
+		if ((obj = json_double(suspend_min)) == NULL)
+			return;
+		json_object_object_add(result, "suspend-minimum-duration-seconds", obj);
+		if ((obj = json_double(suspend_max)) == NULL)
+			return;
+		json_object_object_add(result, "suspend-maximum-duration-seconds", obj);
+		if ((obj = json_double(suspend_mean)) == NULL)
+			return;
+		json_object_object_add(result, "suspend-mean-duration-seconds", obj);
+		if ((obj = json_double(suspend_mode)) == NULL)
+			return;
+		json_object_object_add(result, "suspend-mode-duration-seconds", obj);
+		if ((obj = json_double(suspend_median)) == NULL)
+			return;
+		json_object_object_add(result, "suspend-median-duration-seconds", obj);
+		for (i = 0; (opt_flags & OPT_SKETCH) && (i < PERCENTILES); i++) {
+			char key[64];
+
+			if ((obj = json_double(sketch_quantile(&klog->suspend_sketch,
+					percentiles[i].q))) == NULL)
+				return;
+			snprintf(key, sizeof(key), "suspend-%s-duration-seconds",
+				percentiles[i].key);
+			json_object_object_add(result, key, obj);
+		}
+
+		/* Awake (between suspend) stats */
+		if ((obj = json_double(interval_sum)) == NULL)
+			return;
+		json_object_object_add(result, "awake-total-time-seconds", obj);
+		if ((obj = json_double(interval_percent)) == NULL)
+			return;
+		json_object_object_add(result, "awake-total-time-percent", obj);
+
+		if ((obj = json_double(interval_min)) == NULL)
+			return;
+		json_object_object_add(result, "awake-minimum-duration-seconds", obj);
+		if ((obj = json_double(interval_max)) == NULL)
+			return;
+		json_object_object_add(result, "awake-maximum-duration-seconds", obj);
+		if ((obj = json_double(interval_mean)) == NULL)
+			return;
+		json_object_object_add(result, "awake-mean-duration-seconds", obj);
+		if ((obj = json_double(interval_mode)) == NULL)
+			return;
+		json_object_object_add(result, "awake-mode-duration-seconds", obj);
+		if ((obj = json_double(interval_median)) == NULL)
+			return;
+		json_object_object_add(result, "awake-median-duration-seconds", obj);
+		for (i = 0; (opt_flags & OPT_SKETCH) && (i < PERCENTILES); i++) {
+			char key[64];
+
+			if ((obj = json_double(sketch_quantile(&klog->interval_sketch,
+					percentiles[i].q))) == NULL)
+				return;
+			snprintf(key, sizeof(key), "awake-%s-duration-seconds",
+				percentiles[i].key);
+			json_object_object_add(result, key, obj);
+		}
+	}
+}
+
+/*
+ *  index_pad()
+ *	pad a section of len bytes of an index file to 8 bytes
+ */
+static int index_pad(FILE *fp, const size_t len)
+{
+	static const uint8_t pad[8];
+	const size_t padding = (8 - (len & 7)) & 7;
+
+	if (padding && (fwrite(pad, 1, padding, fp) != padding))
+		return -1;
+	return 0;
+}
+
+/*
+ *  index_write()
+ *	write a section of an index file
+ */
+static int index_write(FILE *fp, const void *data, const size_t len)
+{
+	if (len && (fwrite(data, 1, len, fp) != len))
+		return -1;
+	return index_pad(fp, len);
+}
+
+/*
+ *  index_strtab_len()
+ *	bytes of the strings of a string table, NUL terminated
+ */
+static uint32_t index_strtab_len(const strtab_t *st)
+{
+	uint32_t i, len = 0;
+
+	for (i = 0; i < st->count; i++)
+		len += (uint32_t)strlen(st->strs[i]) + 1;
+	return len;
+}
+
+/*
+ *  index_write_strtab()
+ *	write the strings of a string table in id order
+ */
+static int index_write_strtab(FILE *fp, const strtab_t *st)
+{
+	uint32_t i;
+
+	for (i = 0; i < st->count; i++) {
+		const size_t len = strlen(st->strs[i]) + 1;
+
+		if (fwrite(st->strs[i], 1, len, fp) != len)
+			return -1;
+	}
+	return index_pad(fp, index_strtab_len(st));
+}
+
+/*
+ *  index_write_events()
+ *	write event columns
+ */
+static int index_write_events(FILE *fp, const events_t *ev)
+{
+	if ((index_write(fp, ev->start, ev->n * sizeof(*ev->start)) < 0) ||
+	    (index_write(fp, ev->delta, ev->n * sizeof(*ev->delta)) < 0) ||
+	    (index_write(fp, ev->reason, ev->n * sizeof(*ev->reason)) < 0) ||
+	    (index_write(fp, ev->type, ev->n * sizeof(*ev->type)) < 0) ||
+	    (index_write(fp, ev->accurate, ev->n * sizeof(*ev->accurate)) < 0))
+		return -1;
+	return 0;
+}
+
+/*
+ *  klog_index_save()
+ *	save the parsed suspends of a kernel log to an index file
+ *	that can be reported on again with --index
+ */
+static int klog_index_save(klog_t *klog, const char *filename)
+{
+	index_header_t hdr;
+	FILE *fp;
+	int i, ret = 0;
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, INDEX_MAGIC, sizeof(hdr.magic));
+	hdr.version = INDEX_VERSION;
+	hdr.byte_order = INDEX_BYTE_ORDER;
+	hdr.intervals = klog->suspend_list.n;
+	hdr.durations = klog->suspend_duration_list.n;
+	hdr.kmsg_lost = klog->kmsg_lost;
+	hdr.suspend_succeeded = (uint32_t)klog->suspend_succeeded;
+	hdr.suspend_failed = (uint32_t)klog->suspend_failed;
+	hdr.flags = (klog->needs_config_suspend_time ? INDEX_NEEDS_CONFIG_SUSPEND_TIME : 0) |
+		    (klog->kmsg ? INDEX_KMSG : 0);
+	hdr.filename_len = (uint32_t)strlen(klog->filename);
+	hdr.names = klog->names.count;
+	hdr.names_len = index_strtab_len(&klog->names);
+	hdr.sets = klog->sets.count;
+	hdr.sets_len = index_strtab_len(&klog->sets);
+	for (i = COUNTER_NONE + 1; i < COUNTER_MAX; i++) {
+		const counter_info *counter = klog_counter(klog, i);
+
+		/* Counts past the last name are always zero */
+		hdr.counters[i] = counter->size < klog->names.count ?
+			counter->size : klog->names.count;
+	}
+
+	if ((fp = fopen(filename, "w")) == NULL) {
+		fprintf(stderr, "Cannot create index file %s.\n", filename);
+		return -1;
+	}
+	if ((index_write(fp, &hdr, sizeof(hdr)) < 0) ||
+	    (index_write(fp, klog->filename, hdr.filename_len + 1) < 0) ||
+	    (index_write_strtab(fp, &klog->names) < 0) ||
+	    (index_write_strtab(fp, &klog->sets) < 0) ||
+	    (index_write_events(fp, &klog->suspend_list) < 0) ||
+	    (index_write_events(fp, &klog->suspend_duration_list) < 0))
+		ret = -1;
+	for (i = COUNTER_NONE + 1; (ret == 0) && (i < COUNTER_MAX); i++) {
+		const counter_info *counter = klog_counter(klog, i);
+
+		ret = index_write(fp, counter->counts,
+			hdr.counters[i] * sizeof(*counter->counts));
+	}
+	if (fclose(fp) < 0)
+		ret = -1;
+	if (ret < 0)
+		fprintf(stderr, "Cannot write index file %s.\n", filename);
+
+	return ret;
+}
+
+/*
+ *  index_section()
+ *	next section of len bytes of an index, NULL if the index is
+ *	too short
+ */
+static void *index_section(
+	uint8_t *map,
+	const size_t size,
+	size_t *offset,
+	const uint64_t len)
+{
+	void *ptr = map + *offset;
+
+	if ((*offset > size) || (len > size - *offset))
+		return NULL;
+	*offset += (size_t)((len + 7) & ~7ULL);
+	return ptr;
+}
+
+/*
+ *  index_read_strtab()
+ *	intern n NUL terminated strings in id order, returns false
+ *	if they are not n distinct strings
+ */
+static bool index_read_strtab(strtab_t *st, const char *str, const uint32_t len, const uint32_t n)
+{
+	const char *end = str + len;
+	uint32_t i;
+
+	for (i = 0; i < n; i++) {
+		const char *nul = memchr(str, '\0', (size_t)(end - str));
+
+		if (!nul || (strtab_intern(st, str) != i))
+			return false;
+		str = nul + 1;
+	}
+	return str == end;
+}
+
+/*
+ *  index_read_events()
+ *	check n events of an index and use their columns in place
+ *	from the mapping
+ */
+static bool index_read_events(
+	const klog_t *klog,
+	events_t *ev,
+	uint8_t *map,
+	const size_t size,
+	size_t *offset,
+	const uint64_t n)
+{
+	double *start, *delta;
+	int32_t *reason;
+	uint8_t *type, *accurate;
+	double last = 0.0;
+	uint64_t j;
+
+	start = index_section(map, size, offset, n * sizeof(*start));
+	delta = index_section(map, size, offset, n * sizeof(*delta));
+	reason = index_section(map, size, offset, n * sizeof(*reason));
+	type = index_section(map, size, offset, n * sizeof(*type));
+	accurate = index_section(map, size, offset, n * sizeof(*accurate));
+	if (!start || !delta || !reason || !type || !accurate)
+		return false;
+
+	for (j = 0; j < n; j++) {
+		/*
+		 *  Times are from the kernel or PM clocks and in log order,
+		 *  failures with no time are at 0, awake intervals and
+		 *  durations are more than 0
+		 */
+		if ((type[j] > SUSPEND_DURATION) || (accurate[j] > 1) ||
+		    !(start[j] >= 0.0) || !(start[j] <= INDEX_MAX_TIME) ||
+		    ((start[j] > 0.0) && (start[j] < last)) ||
+		    !(delta[j] >= 0.0) || !(delta[j] <= INDEX_MAX_TIME) ||
+		    ((type[j] != SUSPEND_FAIL) && !(delta[j] > 0.0)) ||
+		    ((reason[j] != REASON_NONE) &&
+		     ((reason[j] < 0) || ((reason[j] & 3) > REASON_FAILED) ||
+		      ((uint32_t)reason[j] >> 2 >= klog->sets.count))))
+			return false;
+		if (start[j] > 0.0)
+			last = start[j];
+	}
+
+	ev->start = start;
+	ev->delta = delta;
+	ev->reason = reason;
+	ev->type = type;
+	ev->accurate = accurate;
+	ev->n = (size_t)n;
+	ev->mapped = true;
+
+	return true;
+}
+
+/*
+ *  index_sets_valid()
+ *	check cause sets only refer to names that exist
+ */
+static bool index_sets_valid(const klog_t *klog)
+{
+	uint32_t i;
+
+	for (i = 0; i < klog->sets.count; i++) {
+		const char *ptr = strtab_str(&klog->sets, i);
+
+		while (*ptr) {
+			char *end;
+
+			if (!isdigit((unsigned char)*ptr) ||
+			    (strtoul(ptr, &end, 10) >= klog->names.count))
+				return false;
+			if (*end == '+')
+				end++;
+			else if (*end)
+				return false;
+			ptr = end;
+		}
+	}
+	return true;
+}
+
+/*
+ *  klog_index_load()
+ *	load the suspends of a kernel log from an index file saved
+ *	with --save-index rather than parsing the kernel log again
+ */
+static klog_t *klog_index_load(const char *filename)
+{
+	const index_header_t *hdr;
+	const char *name, *names, *sets;
+	struct stat buf;
+	klog_t *klog;
+	uint8_t *map;
+	size_t offset = 0, size;
+	uint64_t j;
+	int fd, i;
+
+	if ((fd = open(filename, O_RDONLY)) < 0) {
+		fprintf(stderr, "Cannot open %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	if ((fstat(fd, &buf) < 0) || (buf.st_size < (off_t)sizeof(*hdr))) {
+		fprintf(stderr, "%s is not a suspend-blocker index.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	size = (size_t)buf.st_size;
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	(void)close(fd);
+	if (map == MAP_FAILED) {
+		fprintf(stderr, "Cannot map %s: errno=%d (%s)\n",
+			filename, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+
+	hdr = index_section(map, size, &offset, sizeof(*hdr));
+	if (memcmp(hdr->magic, INDEX_MAGIC, sizeof(hdr->magic)) ||
+	    (hdr->byte_order != INDEX_BYTE_ORDER)) {
+		fprintf(stderr, "%s is not a suspend-blocker index.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	if (hdr->version != INDEX_VERSION) {
+		fprintf(stderr, "%s is a version %" PRIu32 " index, only version %d is supported.\n",
+			filename, hdr->version, INDEX_VERSION);
+		exit(EXIT_FAILURE);
+	}
+
+	name = index_section(map, size, &offset, (uint64_t)hdr->filename_len + 1);
+	names = index_section(map, size, &offset, hdr->names_len);
+	sets = index_section(map, size, &offset, hdr->sets_len);
+	if (!name || name[hdr->filename_len] || !names || !sets ||
+	    (hdr->intervals > size) || (hdr->durations > size) ||
+	    (hdr->suspend_succeeded > INT_MAX) || (hdr->suspend_failed > INT_MAX))
+		goto corrupt;
+
+	klog = klog_new(name);
+	klog->index = map;
+	klog->index_size = size;
+	klog->kmsg = !!(hdr->flags & INDEX_KMSG);
+	klog->kmsg_lost = hdr->kmsg_lost;
+	klog->needs_config_suspend_time = !!(hdr->flags & INDEX_NEEDS_CONFIG_SUSPEND_TIME);
+	klog->suspend_succeeded = (int)hdr->suspend_succeeded;
+	klog->suspend_failed = (int)hdr->suspend_failed;
+
+	if (!index_read_strtab(&klog->names, names, hdr->names_len, hdr->names) ||
+	    !index_read_strtab(&klog->sets, sets, hdr->sets_len, hdr->sets) ||
+	    !index_sets_valid(klog) ||
+	    !index_read_events(klog, &klog->suspend_list, map, size, &offset, hdr->intervals) ||
+	    !index_read_events(klog, &klog->suspend_duration_list, map, size, &offset, hdr->durations))
+		goto corrupt;
+
+	for (i = COUNTER_NONE + 1; i < COUNTER_MAX; i++) {
+		counter_info *counter = klog_counter(klog, i);
+		const int *counts;
+
+		if (hdr->counters[i] > klog->names.count)
+			goto corrupt;
+		counts = index_section(map, size, &offset,
+			(uint64_t)hdr->counters[i] * sizeof(*counts));
+		if (!counts)
+			goto corrupt;
+		if (hdr->counters[i] == 0)
+			continue;
+		for (j = 0; j < hdr->counters[i]; j++)
+			if (counts[j] < 0)
+				goto corrupt;
+		if ((counter->counts = malloc(hdr->counters[i] * sizeof(*counts))) == NULL) {
+			fprintf(stderr, "Out of memory allocating counters\n");
+			exit(EXIT_FAILURE);
+		}
+		memcpy(counter->counts, counts, hdr->counters[i] * sizeof(*counts));
+		counter->size = hdr->counters[i];
+	}
+
+	/* Sketches and histograms are rebuilt as a parse would build them */
+	for (j = 0; j < klog->suspend_list.n; j++) {
+		const double delta = klog->suspend_list.delta[j];
+
+		if (klog->suspend_list.type[j] != SUSPEND_SUCCESS)
+			continue;
+		if (opt_flags & OPT_SKETCH)
+			sketch_add(&klog->interval_sketch, delta);
+		if (opt_flags & OPT_HISTOGRAM)
+			histogram_add(&klog->histograms.intervals, delta, true);
+	}
+	for (j = 0; j < klog->suspend_duration_list.n; j++) {
+		const double delta = klog->suspend_duration_list.delta[j];
+
+		if (opt_flags & OPT_SKETCH)
+			sketch_add(&klog->suspend_sketch, delta);
+		if (opt_flags & OPT_HISTOGRAM)
+			histogram_add(&klog->histograms.durations, delta,
+				klog->suspend_duration_list.accurate[j]);
+	}
+
+	return klog;
+
+corrupt:
+	fprintf(stderr, "Index %s is corrupt.\n", filename);
+	exit(EXIT_FAILURE);
+}
+
+/*
+ *  suspend_blocker()
+ *	parse a kernel log looking for suspend/resume and wakelocks,
+ *	the histograms are added to totals if it is not NULL
+ */
+static void suspend_blocker(
+	FILE *fp,
+	const char *filename,
+	json_object *result,
+	histograms_t *totals,
+	const int opt_freq_min,
+	const int threads)
+{
+	klog_t *klog = klog_new(filename);
+
+	if (opt_flags & OPT_VERBOSE)
+		print("       When         Duration (Seconds)\n");
+
+	/* Files are mapped and parsed in place, stdin and pipes are streamed */
+	if ((fp == stdin) ||
+	    ((klog_read_kmsg(klog, fileno(fp)) < 0) &&
+	     (klog_read_mmap(klog, fileno(fp), threads) < 0)))
+		klog_read_stream(klog, fp);
+
+	klog_report(klog, result, opt_freq_min);
+	if (opt_save_index)
+		(void)klog_index_save(klog, opt_save_index);
+	if (totals)
+		histograms_merge(totals, &klog->histograms);
+	klog_free(klog);
+}
+
+/*
+ *  json_klog_result()
+ *	add a new kernel log result object to the JSON results array,
+ *	returns NULL if JSON output is not required
+ */
+static json_object *json_klog_result(json_object *json_results)
+{
+	json_object *result;
+
+	if (!json_results)
+		return NULL;
+	if ((result = json_obj()) == NULL)
+		return NULL;
+	json_object_array_add(json_results, result);
+
+	return result;
+}
+
+/*
+ *  klog_worker()
+ *	thread to parse kernel logs from the job pool, each report is
+ *	buffered so that reports can be output in argument order
+ */
+static void *klog_worker(void *arg)
+{
+	klog_pool_t *pool = (klog_pool_t *)arg;
 
-	if (opt_flags & OPT_HISTOGRAM) {
-		histogram_dump(suspend_list, "Time between successful suspends:");
-		histogram_dump(suspend_duration_list, "Duration of successful suspends:");
-	}
+	for (;;) {
+		klog_job_t *job;
+		FILE *fp;
 
-	print("Suspends:\n");
-	percent_failed = (suspend_count == 0) ?
-		0.0 : 100.0 * (double)suspend_failed / suspend_count;
-	percent_succeeded = (suspend_count == 0) ?
-		0.0 : 100.0 * (double)suspend_succeeded / suspend_count;
-	total_percent = interval_sum + suspend_sum;
-	suspend_percent = FLOAT_CMP(total_percent, 0.0) ?
-		0.0 : 100.0 * suspend_sum / total_percent;
-	interval_percent = FLOAT_CMP(total_percent, 0.0) ?
-		0.0 : 100.0 * interval_sum / total_percent;
+		(void)pthread_mutex_lock(&pool->lock);
+		job = (pool->next < pool->njobs) ? &pool->jobs[pool->next++] : NULL;
+		(void)pthread_mutex_unlock(&pool->lock);
+		if (!job)
+			break;
 
-	print("  %d suspends aborted (%.2f%%).\n", suspend_failed, percent_failed);
-	print("  %d suspends succeeded (%.2f%%).\n", suspend_succeeded, percent_succeeded);
-	print("  total time: %f seconds (%.2f%%).\n", suspend_sum, suspend_percent);
-	print("  minimum: %f seconds.\n", suspend_min);
-	print("  maximum: %f seconds.\n", suspend_max);
-	print("  mean: %f seconds.\n", suspend_mean);
-	print("  mode: %f seconds.\n", suspend_mode);
-	print("  median: %f seconds.\n", suspend_median);
+		fp_output = open_memstream(&job->text, &job->text_len);
+		if (!fp_output) {
+			fprintf(stderr, "Cannot allocate report buffer for %s.\n", job->filename);
+			exit(EXIT_FAILURE);
+		}
 
-	print("\nTime between successful suspends:\n");
-	print("  total time: %f seconds (%.2f%%).\n", interval_sum, interval_percent);
-	print("  minimum: %f seconds.\n", interval_min);
-	print("  maximum: %f seconds.\n", interval_max);
-	print("  mean: %f seconds.\n", interval_mean);
-	print("  mode: %f seconds.\n", interval_mode);
-	print("  median: %f seconds.\n", interval_median);
+		print("%s:\n", job->filename);
+		if ((fp = fopen(job->filename, "r")) == NULL) {
+			job->open_failed = true;
+		} else {
+			if (pool->json)
+				job->result = json_obj();
+			suspend_blocker(fp, job->filename, job->result,
+				&job->histograms, pool->opt_freq_min, 1);
+			(void)fclose(fp);
+		}
+		(void)fclose(fp_output);
+		fp_output = NULL;
 
-	if ((suspend_count > 0) && needs_config_suspend_time) {
-		print("\nNOTE: suspend times are very dubious, enable kernel config setting\n");
-		print("      CONFIG_SUSPEND_TIME=y for accurate suspend times.\n");
+		(void)pthread_mutex_lock(&pool->lock);
+		job->done = true;
+		(void)pthread_cond_broadcast(&pool->cond);
+		(void)pthread_mutex_unlock(&pool->lock);
 	}
+	return NULL;
+}
 
-	if (opt_flags & OPT_FREQUENCY_REPORT) {
-		frequency_dump(suspend_list, opt_freq_min);
+/*
+ *  suspend_blocker_files()
+ *	parse kernel logs concurrently on a pool of threads and output
+ *	the reports in the order the kernel logs were given
+ */
+static void suspend_blocker_files(
+	char **filenames,
+	const size_t n,
+	json_object *json_results,
+	histograms_t *totals,
+	const int opt_freq_min)
+{
+	klog_pool_t pool;
+	pthread_t *threads;
+	size_t i, nthreads = (size_t)opt_threads;
+
+	if (nthreads > n)
+		nthreads = n;
+
+	memset(&pool, 0, sizeof(pool));
+	pool.jobs = calloc(n, sizeof(*pool.jobs));
+	threads = calloc(nthreads, sizeof(*threads));
+	if (!pool.jobs || !threads) {
+		fprintf(stderr, "Out of memory allocating job pool\n");
+		exit(EXIT_FAILURE);
+	}
+	for (i = 0; i < n; i++)
+		pool.jobs[i].filename = filenames[i];
+	pool.njobs = n;
+	pool.json = (json_results != NULL);
+	pool.opt_freq_min = opt_freq_min;
+	(void)pthread_mutex_init(&pool.lock, NULL);
+	(void)pthread_cond_init(&pool.cond, NULL);
+
+	for (i = 0; i < nthreads; i++) {
+		if (pthread_create(&threads[i], NULL, klog_worker, &pool) != 0) {
+			fprintf(stderr, "Cannot create worker thread: errno=%d (%s)\n",
+				errno, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	if (json_results) {
-		/* suspend stats */
-		if ((obj = json_int(suspend_count)) == NULL)
-			goto out;
-		json_object_object_add(result, "suspends-attempted", obj);
-		if ((obj = json_int(suspend_failed)) == NULL)
-			goto out;
-		json_object_object_add(result, "suspends-aborted", obj);
-		if ((obj = json_int(suspend_succeeded)) == NULL)
-			goto out;
-		json_object_object_add(result, "suspends-succeeded", obj);
-
-		if ((obj = json_double(percent_failed)) == NULL)
-			goto out;
-		json_object_object_add(result, "suspends-aborted-percent", obj);
-		if ((obj = json_double(percent_succeeded)) == NULL)
-			goto out;
-		json_object_object_add(result, "suspends-succeeded-percent", obj);
-
-		if ((obj = json_double(suspend_sum)) == NULL)
-			goto out;
-		json_object_object_add(result, "suspends-total-time-seconds", obj);
-		if ((obj = json_double(suspend_percent)) == NULL)
-			goto out;
-		json_object_object_add(result, "suspends-total-time-percent", obj);
-
-		if ((obj = json_double(suspend_min)) == NULL)
-			goto out;
-		json_object_object_add(result, "suspend-minimum-duration-seconds", obj);
-		if ((obj = json_double(suspend_max)) == NULL)
-			goto out;
-		json_object_object_add(result, "suspend-maximum-duration-seconds", obj);
-		if ((obj = json_double(suspend_mean)) == NULL)
-			goto out;
-		json_object_object_add(result, "suspend-mean-duration-seconds", obj);
-		if ((obj = json_double(suspend_mode)) == NULL)
-			goto out;
-		json_object_object_add(result, "suspend-mode-duration-seconds", obj);
-		if ((obj = json_double(suspend_median)) == NULL)
-			goto out;
-		json_object_object_add(result, "suspend-median-duration-seconds", obj);
+	for (i = 0; i < n; i++) {
+		klog_job_t *job = &pool.jobs[i];
 
-		/* Awake (between suspend) stats */
-		if ((obj = json_double(interval_sum)) == NULL)
-			goto out;
-		json_object_object_add(result, "awake-total-time-seconds", obj);
-		if ((obj = json_double(interval_percent)) == NULL)
-			goto out;
-		json_object_object_add(result, "awake-total-time-percent", obj);
+		(void)pthread_mutex_lock(&pool.lock);
+		while (!job->done)
+			(void)pthread_cond_wait(&pool.cond, &pool.lock);
+		(void)pthread_mutex_unlock(&pool.lock);
 
-		if ((obj = json_double(interval_min)) == NULL)
-			goto out;
-		json_object_object_add(result, "awake-minimum-duration-seconds", obj);
-		if ((obj = json_double(interval_max)) == NULL)
-			goto out;
-		json_object_object_add(result, "awake-maximum-duration-seconds", obj);
-		if ((obj = json_double(interval_mean)) == NULL)
-			goto out;
-		json_object_object_add(result, "awake-mean-duration-seconds", obj);
-		if ((obj = json_double(interval_mode)) == NULL)
-			goto out;
-		json_object_object_add(result, "awake-mode-duration-seconds", obj);
-		if ((obj = json_double(interval_median)) == NULL)
-			goto out;
-		json_object_object_add(result, "awake-median-duration-seconds", obj);
+		fwrite(job->text, 1, job->text_len, stdout);
+		free(job->text);
+		if (job->open_failed) {
+			fflush(stdout);
+			fprintf(stderr, "Cannot open %s.\n", job->filename);
+			exit(EXIT_FAILURE);
+		}
+		if (job->result)
+			json_object_array_add(json_results, job->result);
+		/* Totals are added up in argument order, as a serial parse would */
+		histograms_merge(totals, &job->histograms);
+		histograms_free(&job->histograms);
 	}
 
-out:
-	free(resume_cause);
-	free(suspend_fail_cause);
-	free_time_delta_info_list(suspend_list);
-	free_time_delta_info_list(suspend_duration_list);
-	counter_free(wakelocks_count);
-	counter_free(resume_causes);
-	counter_free(suspend_fail_causes);
-	counter_free(wakeup_sources);
+	for (i = 0; i < nthreads; i++)
+		(void)pthread_join(threads[i], NULL);
+	(void)pthread_cond_destroy(&pool.cond);
+	(void)pthread_mutex_destroy(&pool.lock);
+	free(threads);
+	free(pool.jobs);
 }
 
 
@@ -1674,19 +6276,249 @@ static int json_write(json_object *obj, const char *filename)
 	return 0;
 }
 
+/*
+ *  time_now()
+ *	monotonic time in seconds
+ */
+static double time_now(void)
+{
+	return clock_seconds(CLOCK_MONOTONIC);
+}
+
+/*
+ *  klog_follow_report()
+ *	report on a kernel log being followed, the JSON file is
+ *	rewritten with the latest results on every report
+ */
+static void klog_follow_report(
+	klog_t *klog,
+	const char *json_file,
+	const int opt_freq_min)
+{
+	json_object *json_results = NULL, *array, *result = NULL;
+
+	if (json_file) {
+		if ((json_results = json_obj()) == NULL)
+			return;
+		if ((array = json_array()) == NULL) {
+			json_object_put(json_results);
+			return;
+		}
+		json_object_object_add(json_results, "wakelock-stats-from-klog", array);
+		result = json_klog_result(array);
+	}
+
+	print("%s:\n", klog->filename);
+	klog_report(klog, result, opt_freq_min);
+	print("\n");
+	(void)fflush(stdout);
+
+	if (json_results)
+		(void)json_write(json_results, json_file);
+}
+
+/*
+ *  klog_follow_watch()
+ *	watch the kernel log for appends, replacing any previous watch
+ */
+static int klog_follow_watch(const int ifd, const int wd, const char *filename)
+{
+	if (wd >= 0)
+		(void)inotify_rm_watch(ifd, wd);
+	return inotify_add_watch(ifd, filename,
+		IN_MODIFY | IN_ATTRIB | IN_MOVE_SELF | IN_DELETE_SELF);
+}
+
+/*
+ *  suspend_blocker_follow()
+ *	follow a kernel log as it grows, keeping the suspend state and
+ *	counters alive and parsing only newly appended text, the report
+ *	is emitted every interval seconds. A rotated log is detected by
+ *	a change of inode and the new log is followed from its start.
+ *	/dev/kmsg is polled directly for new records.
+ */
+static void suspend_blocker_follow(
+	const char *filename,
+	const char *json_file,
+	const int opt_freq_min,
+	const double interval)
+{
+	klog_t *klog = klog_new(filename);
+	struct stat statbuf;
+	char *buf, *dir = NULL, *ptr;
+	int fd, ifd = -1, wd = -1;
+	double next_report;
+	bool device;
+
+	if ((fd = open(filename, O_RDONLY | O_NONBLOCK)) < 0) {
+		fprintf(stderr, "Cannot open %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	if (fstat(fd, &statbuf) < 0) {
+		fprintf(stderr, "Cannot stat %s: errno=%d (%s)\n",
+			filename, errno, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+	if ((buf = malloc(FOLLOW_BUF_SIZE)) == NULL) {
+		fprintf(stderr, "Out of memory allocating follow buffers\n");
+		exit(EXIT_FAILURE);
+	}
+
+	/* /dev/kmsg can't be rotated and is polled for new records */
+	device = klog->kmsg && S_ISCHR(statbuf.st_mode);
+	if (!device) {
+		if ((ifd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+			fprintf(stderr, "inotify_init1 failed: errno=%d (%s)\n",
+				errno, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		if ((dir = strdup(filename)) == NULL) {
+			fprintf(stderr, "Out of memory allocating follow buffers\n");
+			exit(EXIT_FAILURE);
+		}
+
+		/* A rotated log shows up as a new file in the log's directory */
+		ptr = strrchr(dir, '/');
+		if (ptr)
+			*(ptr == dir ? ptr + 1 : ptr) = '\0';
+		else
+			strcpy(dir, ".");
+		(void)inotify_add_watch(ifd, dir, IN_CREATE | IN_MOVED_TO);
+		wd = klog_follow_watch(ifd, wd, filename);
+	}
+
+	if (opt_flags & OPT_VERBOSE)
+		print("       When         Duration (Seconds)\n");
+
+	next_report = time_now() + interval;
+	while (keep_running) {
+		struct stat newbuf;
+		struct pollfd pfd;
+		double now;
+
+		klog_read_fd(klog, fd, buf);
+
+		if (!device && (stat(filename, &newbuf) == 0)) {
+			if ((newbuf.st_ino != statbuf.st_ino) ||
+			    (newbuf.st_dev != statbuf.st_dev)) {
+				int newfd = open(filename, O_RDONLY | O_NONBLOCK);
+
+				/*
+				 *  Log rotated, read what was appended to the old
+				 *  log before it was renamed and end its last line
+				 */
+				if (newfd >= 0) {
+					klog_read_fd(klog, fd, buf);
+					klog_parse_flush(klog);
+					(void)close(fd);
+					fd = newfd;
+					statbuf = newbuf;
+					wd = klog_follow_watch(ifd, wd, filename);
+					continue;
+				}
+			} else if (newbuf.st_size < lseek(fd, 0, SEEK_CUR)) {
+				/* Log truncated in place, start again from the top */
+				klog_parse_flush(klog);
+				(void)lseek(fd, 0, SEEK_SET);
+				continue;
+			}
+		}
+
+		now = time_now();
+		if (now >= next_report) {
+			klog_follow_report(klog, json_file, opt_freq_min);
+			next_report = now + interval;
+		}
+
+		pfd.fd = device ? fd : ifd;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if ((poll(&pfd, 1, (int)((next_report - now) * 1000.0) + 1) > 0) && !device) {
+			/* Drain the events, the log is re-read regardless */
+			while (read(ifd, buf, FOLLOW_BUF_SIZE) > 0)
+				;
+		}
+	}
+
+	klog_read_fd(klog, fd, buf);
+	klog_parse_flush(klog);
+	klog_follow_report(klog, json_file, opt_freq_min);
+
+	if (ifd >= 0)
+		(void)close(ifd);
+	(void)close(fd);
+	free(dir);
+	free(buf);
+	klog_free(klog);
+}
+
+/*
+ *  parse_window_time()
+ *	parse a "YYYY-MM-DD HH:MM:SS" -t or -u option time
+ */
+static double parse_window_time(const char *str, int *year, const char opt)
+{
+	timestamp ts;
+
+	parse_pm_timestamp(str, &ts);
+	if (!ts.pm_whence_valid) {
+		fprintf(stderr, "-%c option must be a \"YYYY-MM-DD HH:MM:SS\" time\n", opt);
+		exit(EXIT_FAILURE);
+	}
+	*year = atoi(str);
+
+	return ts.pm_whence;
+}
+
+/*
+ *  parse_storm()
+ *	parse the -W N/secs wakeup storm rate
+ */
+static bool parse_storm(const char *arg)
+{
+	char *end;
+	const unsigned long n = strtoul(arg, &end, 10);
+
+	if ((end == arg) || (*end != '/') || (n < 2) || (n > 1000000))
+		return false;
+	arg = end + 1;
+	opt_storm_window = strtod(arg, &end);
+	if ((end == arg) || *end || !(opt_storm_window > 0.0))
+		return false;
+	opt_storm_count = (uint32_t)n;
+	return true;
+}
+
 static void show_help(char * const argv[])
 {
 	printf("%s, version %s\n\n", APP_NAME, VERSION);
 	printf("usage: %s [options] [kernel_log]\n", argv[0]);
 	printf("\t-b       list blocking wakelock names and count.\n");
+	printf("\t-c N     list the N slowest device callbacks (--callbacks).\n");
+	printf("\t-C dir   record -w wakelock snapshots to dir (--record).\n");
 	printf("\t-d       bucket histogram into 10s of seconds rather than powers of 2.\n");
+	printf("\t-D dir   read -w wakelocks from /proc and /sys under dir (--root).\n");
 	printf("\t-f mins  dump suspend frequency stats for importing into spreadsheet.\n");
+	printf("\t-F secs  follow kernel log, report every secs seconds (--follow).\n");
 	printf("\t-h       this help.\n");
 	printf("\t-H       histogram of times between suspend and suspend duration.\n");
+	printf("\t-i file  report on suspends saved in an index file (--index).\n");
+	printf("\t-I secs  sample -w wakelocks every secs seconds (--interval).\n");
+	printf("\t-j N     parse kernel log files using N threads.\n");
+	printf("\t-k       read /dev/kmsg or /dev/kmsg dump files (--kmsg).\n");
 	printf("\t-o       output results in json format to an named files.\n");
+	printf("\t-p       report latency of each suspend and resume phase (--phases).\n");
+	printf("\t-P N     histogram every bucket to N significant digits (--precision).\n");
 	printf("\t-r       list causes of resume.\n");
+	printf("\t-R file  read extra suspend/resume rules from file (--rules).\n");
+	printf("\t-s file  save parsed suspends to an index file (--save-index).\n");
+	printf("\t-S       estimate percentiles in bounded memory (--sketch).\n");
+	printf("\t-t time  only report from \"YYYY-MM-DD HH:MM:SS\" time on (--since).\n");
+	printf("\t-u time  only report up to \"YYYY-MM-DD HH:MM:SS\" time (--until).\n");
 	printf("\t-v       verbose information.\n");
 	printf("\t-w       profile wakelocks.\n");
+	printf("\t-W N/s   report N or more wakeups of a cause in s seconds (--storms).\n");
+	printf("\t-Y dir   profile wakelocks from snapshots recorded with -C (--replay).\n");
 }
 
 static void handle_sig(int dummy)
@@ -1695,23 +6527,94 @@ static void handle_sig(int dummy)
 	keep_running = false;
 }
 
+/*
+ *  signals_init()
+ *	catch signals so that profiling and following can be
+ *	stopped cleanly
+ */
+static void signals_init(void)
+{
+	struct sigaction new_action;
+	int i;
+
+	memset(&new_action, 0, sizeof(new_action));
+	for (i = 0; signals[i] != -1; i++) {
+		new_action.sa_handler = handle_sig;
+		sigemptyset(&new_action.sa_mask);
+		new_action.sa_flags = 0;
+
+		if (sigaction(signals[i], &new_action, NULL) < 0) {
+			fprintf(stderr, "sigaction failed: errno=%d (%s)\n",
+				errno, strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+static const struct option long_options[] = {
+	{ "callbacks",	required_argument,	NULL,	'c' },
+	{ "follow",	required_argument,	NULL,	'F' },
+	{ "index",	required_argument,	NULL,	'i' },
+	{ "interval",	required_argument,	NULL,	'I' },
+	{ "kmsg",	no_argument,		NULL,	'k' },
+	{ "phases",	no_argument,		NULL,	'p' },
+	{ "precision",	required_argument,	NULL,	'P' },
+	{ "record",	required_argument,	NULL,	'C' },
+	{ "replay",	required_argument,	NULL,	'Y' },
+	{ "root",	required_argument,	NULL,	'D' },
+	{ "rules",	required_argument,	NULL,	'R' },
+	{ "save-index",	required_argument,	NULL,	's' },
+	{ "since",	required_argument,	NULL,	't' },
+	{ "sketch",	no_argument,		NULL,	'S' },
+	{ "storms",	required_argument,	NULL,	'W' },
+	{ "until",	required_argument,	NULL,	'u' },
+	{ NULL,		0,			NULL,	0 },
+};
+
 int main(int argc, char **argv)
 {
 	char *opt_json_file = NULL;
+	char *opt_rules_file = NULL;
+	char *opt_index_file = NULL;
+	char *opt_wakelock_replay = NULL;
 	json_object *json_results = NULL;
 	int opt_freq_min = 60;
+	double opt_follow_interval = 0.0;
 
 	for (;;) {
-		int c = getopt(argc, argv, "bhHrvo:qw:df:");
+		int c = getopt_long(argc, argv, "bc:C:D:hHi:I:j:kpP:rR:s:St:u:vo:qw:W:Y:df:F:",
+			long_options, NULL);
 		if (c == -1)
 			break;
 		switch (c) {
 		case 'b':
 			opt_flags |= OPT_WAKELOCK_BLOCKERS;
 			break;
+		case 'c':
+			opt_flags |= OPT_CALLBACKS;
+			opt_callbacks = atoi(optarg);
+			if (opt_callbacks < 1) {
+				fprintf(stderr, "-c option must be at least 1\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'C':
+			opt_wakelock_record = optarg;
+			break;
+		case 'D':
+			opt_wakelock_root = optarg;
+			break;
 		case 'd':
 			opt_flags |= OPT_HISTOGRAM_DECADES;
 			break;
+		case 'F':
+			opt_flags |= OPT_FOLLOW;
+			opt_follow_interval = atof(optarg);
+			if (opt_follow_interval <= 0.0) {
+				fprintf(stderr, "-F option must be more than 0 seconds\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'f':
 			opt_flags |= OPT_FREQUENCY_REPORT;
 			opt_freq_min = atoi(optarg);	/* Minutes */
@@ -1720,9 +6623,56 @@ int main(int argc, char **argv)
 				exit(EXIT_FAILURE);
 			}
 			break;
+		case 'i':
+			opt_index_file = optarg;
+			break;
+		case 'I':
+			opt_flags |= OPT_WAKELOCK_SAMPLE;
+			opt_wakelock_interval = atof(optarg);
+			if (opt_wakelock_interval <= 0.0) {
+				fprintf(stderr, "-I option must be more than 0 seconds\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'j':
+			opt_threads = atoi(optarg);
+			if ((opt_threads < 1) || (opt_threads > MAX_THREADS)) {
+				fprintf(stderr, "-j option must be 1 to %d threads\n", MAX_THREADS);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'k':
+			opt_flags |= OPT_KMSG;
+			break;
+		case 'P':
+			opt_flags |= OPT_HISTOGRAM_PRECISION;
+			opt_histogram_digits = atoi(optarg);
+			if ((opt_histogram_digits < 1) || (opt_histogram_digits > 3)) {
+				fprintf(stderr, "-P option must be 1 to 3 digits\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
 		case 'r':
 			opt_flags |= OPT_RESUME_CAUSES;
 			break;
+		case 'R':
+			opt_rules_file = optarg;
+			break;
+		case 's':
+			opt_flags |= OPT_SAVE_INDEX;
+			opt_save_index = optarg;
+			break;
+		case 'S':
+			opt_flags |= OPT_SKETCH;
+			break;
+		case 't':
+			opt_flags |= OPT_SINCE;
+			opt_since = parse_window_time(optarg, &opt_since_year, 't');
+			break;
+		case 'u':
+			opt_flags |= OPT_UNTIL;
+			opt_until = parse_window_time(optarg, &opt_until_year, 'u');
+			break;
 		case 'v':
 			opt_flags |= OPT_VERBOSE;
 			break;
@@ -1735,6 +6685,9 @@ int main(int argc, char **argv)
 		case 'o':
 			opt_json_file = optarg;
 			break;
+		case 'p':
+			opt_flags |= OPT_PHASES;
+			break;
 		case 'q':
 			opt_flags |= OPT_QUIET;
 			opt_flags &= ~OPT_VERBOSE;
@@ -1743,76 +6696,168 @@ int main(int argc, char **argv)
 			opt_flags |= OPT_PROC_WAKELOCK;
 			opt_wakelock_duration = atof(optarg);
 			break;
+		case 'W':
+			opt_flags |= OPT_STORMS;
+			if (!parse_storm(optarg)) {
+				fprintf(stderr, "-W option must be N/s, 2 or more wakeups in "
+					"more than 0 seconds\n");
+				exit(EXIT_FAILURE);
+			}
+			break;
+		case 'Y':
+			opt_wakelock_replay = optarg;
+			break;
 		}
 	}
 
+	if (opt_index_file && ((optind < argc) ||
+	    (opt_flags & (OPT_FOLLOW | OPT_SAVE_INDEX | OPT_SINCE | OPT_UNTIL)))) {
+		fprintf(stderr, "-i option cannot be used with kernel logs, -F, -s, -t or -u\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt_index_file && (opt_flags & (OPT_PHASES | OPT_CALLBACKS | OPT_STORMS))) {
+		fprintf(stderr, "-c, -p and -W options cannot be used with -i, "
+			"index files do not hold latencies or wakeup times\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt_wakelock_replay && (opt_flags & OPT_PROC_WAKELOCK)) {
+		fprintf(stderr, "-Y option cannot be used with -w\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((opt_flags & OPT_WAKELOCK_SAMPLE) && !(opt_flags & OPT_PROC_WAKELOCK) &&
+	    !opt_wakelock_replay) {
+		fprintf(stderr, "-I option requires the -w or -Y option\n");
+		exit(EXIT_FAILURE);
+	}
+	if (opt_wakelock_record && !(opt_flags & OPT_PROC_WAKELOCK)) {
+		fprintf(stderr, "-C option requires the -w option\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((opt_flags & OPT_SINCE) && (opt_flags & OPT_UNTIL) && (opt_until < opt_since)) {
+		fprintf(stderr, "-u time must not be before -t time\n");
+		exit(EXIT_FAILURE);
+	}
+	if ((opt_flags & OPT_SAVE_INDEX) && ((argc - optind > 1) || (opt_flags & OPT_FOLLOW))) {
+		fprintf(stderr, "-s option needs a single kernel log and cannot be used with -F\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if (opt_json_file) {
 		if ((json_results = json_obj()) == NULL)
 			exit(EXIT_FAILURE);
 	}
 
 	if (opt_flags & OPT_PROC_WAKELOCK) {
-		struct sigaction new_action;
-		struct timeval tv, tv_start, tv_now;
-		int i;
-		double duration;
-
-		memset(&new_action, 0, sizeof(new_action));
-		for (i = 0; signals[i] != -1; i++) {
-			new_action.sa_handler = handle_sig;
-			sigemptyset(&new_action.sa_mask);
-			new_action.sa_flags = 0;
-
-			if (sigaction(signals[i], &new_action, NULL) < 0) {
-				fprintf(stderr, "sigaction failed: errno=%d (%s)\n",
-					errno, strerror(errno));
-				exit(EXIT_FAILURE);
-			}
-		}
-
-		if (gettimeofday(&tv_start, NULL) < 0) {
-			fprintf(stderr, "gettimeofday failed: errno=%d (%s)\n",
+		double boot_start, mono_start, duration, awake;
+		double last_sample = 0.0, last_awake = 0.0, next_sample = opt_wakelock_interval;
+		bool sampled = false;
+		int tfd;
+
+		signals_init();
+
+		/*
+		 *  CLOCK_BOOTTIME keeps counting while suspended but, unlike
+		 *  CLOCK_BOOTTIME_ALARM, its timers do not wake the system,
+		 *  CLOCK_MONOTONIC stops while suspended so the difference
+		 *  is the time spent suspended
+		 */
+		if ((tfd = timerfd_create(CLOCK_BOOTTIME, TFD_CLOEXEC)) < 0) {
+			fprintf(stderr, "timerfd_create failed: errno=%d (%s)\n",
 				errno, strerror(errno));
 			exit(EXIT_FAILURE);
 		}
+		boot_start = clock_seconds(CLOCK_BOOTTIME);
+		mono_start = clock_seconds(CLOCK_MONOTONIC);
 
-		do {
-			int ret;
+		wakelock_read(WAKELOCK_START);
+		if (opt_flags & OPT_WAKELOCK_SAMPLE)
+			wakelock_sample_start();
 
-			wakelock_read(WAKELOCK_START);
-			tv.tv_sec = (long)opt_wakelock_duration;
-			tv.tv_usec = (long)((opt_wakelock_duration - tv.tv_sec) * 1000000.0);
-			ret = select(0, NULL, NULL, NULL, &tv);
-			if (ret < 0) {
+		duration = 0.0;
+		awake = 0.0;
+		do {
+			/* Sleep until the end of the run or the next -I sample */
+			double secs = opt_wakelock_duration - duration;
+			struct itimerspec its;
+			bool interrupted = false;
+			uint64_t expirations;
+
+			if ((opt_flags & OPT_WAKELOCK_SAMPLE) && (next_sample - duration < secs))
+				secs = next_sample - duration;
+			/* A zero it_value would disarm the timer */
+			if (secs < 0.000000001)
+				secs = 0.000000001;
+			memset(&its, 0, sizeof(its));
+			its.it_value.tv_sec = (time_t)secs;
+			its.it_value.tv_nsec = (long)((secs - (double)its.it_value.tv_sec) * 1000000000.0);
+			if (timerfd_settime(tfd, 0, &its, NULL) < 0) {
+				fprintf(stderr, "timerfd_settime failed: errno=%d (%s)\n",
+					errno, strerror(errno));
+				exit(EXIT_FAILURE);
+			}
+			if (read(tfd, &expirations, sizeof(expirations)) < 0) {
 				if (errno == EINTR) {
 					fprintf(stderr, "Interrupted by a signal\n");
-					if (gettimeofday(&tv_now, NULL) < 0) {
-						fprintf(stderr, "gettimeofday failed: errno=%d (%s)\n",
-							errno, strerror(errno));
-						exit(EXIT_FAILURE);
-					}
-					duration = timeval_to_double(&tv_now) - timeval_to_double(&tv_start);
-					break;
-				}
-				if (errno) {
-					fprintf(stderr, "Select failed: %s\n", strerror(errno));
+					interrupted = true;
+				} else {
+					fprintf(stderr, "timerfd read failed: %s\n", strerror(errno));
 					exit(EXIT_FAILURE);
 				}
 			}
-			if (gettimeofday(&tv_now, NULL) < 0) {
-				fprintf(stderr, "gettimeofday failed: errno=%d (%s)\n",
-					errno, strerror(errno));
-				exit(EXIT_FAILURE);
+			duration = clock_seconds(CLOCK_BOOTTIME) - boot_start;
+			awake = clock_seconds(CLOCK_MONOTONIC) - mono_start;
+			sampled = (opt_flags & OPT_WAKELOCK_SAMPLE) &&
+				(interrupted || (duration >= next_sample) ||
+				 (duration >= opt_wakelock_duration));
+			if (sampled) {
+				(void)wakelock_read(WAKELOCK_END);
+				wakelock_sample_take(last_sample, duration, awake - last_awake);
+				last_sample = duration;
+				last_awake = awake;
+				/* Samples are on a fixed grid so they do not drift */
+				while (next_sample <= duration)
+					next_sample += opt_wakelock_interval;
 			}
-			duration = timeval_to_double(&tv_now) - timeval_to_double(&tv_start);
+			if (interrupted)
+				break;
 		} while (keep_running && (duration < opt_wakelock_duration));
-
-		wakelock_read(WAKELOCK_END);
-		wakelock_check(opt_wakelock_duration, duration, json_results);
+		(void)close(tfd);
+
+		/* The last -I sample has already read the end stats */
+		if (!sampled)
+			wakelock_read(WAKELOCK_END);
+		wakelock_check(opt_wakelock_duration, duration, awake, json_results);
+		if (json_results && (opt_flags & OPT_WAKELOCK_SAMPLE))
+			wakelock_samples_json(json_results);
 		wakelock_free();
+	} else if (opt_wakelock_replay) {
+		wakelock_replay(opt_wakelock_replay, json_results);
+	} else if (opt_flags & OPT_FOLLOW) {
+		const char *filename = argv[optind];
+
+		/* With no kernel log given, -k follows the kernel ring buffer */
+		if ((optind == argc) && (opt_flags & OPT_KMSG)) {
+			filename = KMSG_DEVICE;
+		} else if (argc - optind != 1) {
+			fprintf(stderr, "-F option requires one kernel log file to follow\n");
+			exit(EXIT_FAILURE);
+		}
+		signals_init();
+		patterns_compile(opt_rules_file);
+		suspend_blocker_follow(filename, opt_json_file,
+			opt_freq_min, opt_follow_interval);
+		patterns_free();
+		/* The JSON file has been written on every report */
+		opt_json_file = NULL;
+		if (json_results)
+			json_object_put(json_results);
 	} else {
 		json_object *obj = NULL;
+		histograms_t totals;
+		const int logs = argc - optind;
 
+		memset(&totals, 0, sizeof(totals));
+		patterns_compile(opt_rules_file);
 
 		if (json_results) {
 			if ((obj = json_array()) == NULL)
@@ -1820,9 +6865,35 @@ int main(int argc, char **argv)
 			json_object_object_add(json_results, "wakelock-stats-from-klog", obj);
 		}
 
-		if (optind == argc) {
+		if (opt_index_file) {
+			klog_t *klog = klog_index_load(opt_index_file);
+
+			print("%s:\n", klog->filename);
+			klog_report(klog, json_klog_result(obj), opt_freq_min);
+			klog_free(klog);
+		} else if ((optind == argc) && (opt_flags & OPT_KMSG)) {
+			FILE *fp;
+
+			/* With no kernel log given, -k reads the kernel ring buffer */
+			print("%s:\n", KMSG_DEVICE);
+			if ((fp = fopen(KMSG_DEVICE, "r")) == NULL) {
+				fprintf(stderr, "Cannot open %s.\n", KMSG_DEVICE);
+				exit(EXIT_FAILURE);
+			}
+			suspend_blocker(fp, KMSG_DEVICE, json_klog_result(obj),
+				NULL, opt_freq_min, opt_threads);
+			(void)fclose(fp);
+		} else if (optind == argc) {
 			print("stdin:\n");
-			suspend_blocker(stdin, "stdin", obj, opt_freq_min);
+			suspend_blocker(stdin, "stdin", json_klog_result(obj),
+				NULL, opt_freq_min, opt_threads);
+		}
+
+		/* Many kernel logs are parsed concurrently, one per thread */
+		if ((opt_threads > 1) && (argc - optind > 1)) {
+			suspend_blocker_files(argv + optind, (size_t)(argc - optind),
+				obj, &totals, opt_freq_min);
+			optind = argc;
 		}
 
 		while (optind < argc) {
@@ -1833,10 +6904,19 @@ int main(int argc, char **argv)
 				fprintf(stderr, "Cannot open %s.\n", argv[optind]);
 				exit(EXIT_FAILURE);
 			}
-			suspend_blocker(fp, argv[optind], obj, opt_freq_min);
+			suspend_blocker(fp, argv[optind], json_klog_result(obj),
+				&totals, opt_freq_min, opt_threads);
 			(void)fclose(fp);
 			optind++;
 		}
+
+		if ((opt_flags & OPT_HISTOGRAM) && (logs > 1)) {
+			print("All kernel logs:\n");
+			histogram_dump(&totals.intervals, "Time between successful suspends:");
+			histogram_dump(&totals.durations, "Duration of successful suspends:");
+		}
+		histograms_free(&totals);
+		patterns_free();
 	}
 
 	if (opt_json_file)
@@ -10,3 +10,100 @@ do
 		echo "$I: FAILED"
 	fi
 done
+
+for I in *.kmsg
+do
+	./suspend-blocker -k -v -b -r $I > /tmp/$I.output
+	diff $I.output /tmp/$I.output
+	if [ $? -eq 0 ]; then
+		echo "$I: PASSED"
+	else
+		echo "$I: FAILED"
+	fi
+done
+
+#
+#  Kernel logs given as files are mapped rather than read, and with -j
+#  large ones are split into chunks and several are parsed at once
+#
+for J in "" "-j 4"
+do
+	for I in *.klog
+	do
+		./suspend-blocker $J -v -b -r $I | sed "1s/^$I:\$/stdin:/" > /tmp/$I.output
+		diff $I.output /tmp/$I.output
+		if [ $? -eq 0 ]; then
+			echo "$I${J:+ $J} mapped: PASSED"
+		else
+			echo "$I${J:+ $J} mapped: FAILED"
+		fi
+	done
+done
+
+rm -f /tmp/multi.output
+for I in *.klog
+do
+	sed "1s/^stdin:\$/$I:/" $I.output >> /tmp/multi.output
+done
+./suspend-blocker -j 4 -v -b -r *.klog | diff /tmp/multi.output -
+if [ $? -eq 0 ]; then
+	echo "*.klog -j 4: PASSED"
+else
+	echo "*.klog -j 4: FAILED"
+fi
+
+#
+#  Compressed kernel logs are decompressed as they are parsed
+#
+for Z in gzip xz
+do
+	$Z -c nexus4.klog > /tmp/nexus4.klog.$Z
+	./suspend-blocker -v -b -r /tmp/nexus4.klog.$Z | \
+		sed "1s/^\/tmp\/nexus4.klog.$Z:\$/stdin:/" > /tmp/nexus4.klog.output
+	diff nexus4.klog.output /tmp/nexus4.klog.output
+	if [ $? -eq 0 ]; then
+		echo "nexus4.klog $Z: PASSED"
+	else
+		echo "nexus4.klog $Z: FAILED"
+	fi
+	rm -f /tmp/nexus4.klog.$Z
+done
+
+#
+#  Extra rules for a kernel log dialect that is not built in, -R, they
+#  must still fire on the lines of the built in -p and -c rules
+#
+./suspend-blocker -R custom.rules -v -b -r -p -c 5 custom.rlog > /tmp/custom.rlog.output
+diff custom.rlog.output /tmp/custom.rlog.output
+if [ $? -eq 0 ]; then
+	echo "custom.rlog -R -p -c: PASSED"
+else
+	echo "custom.rlog -R -p -c: FAILED"
+fi
+
+#
+#  -c must leave device callback lines as they were for the rules after it
+#
+printf 'pattern="call " offset=5 stop=" " counter=wakeup-sources\n' > /tmp/callback.rules
+./suspend-blocker -R /tmp/callback.rules -r custom.rlog | \
+	grep -A3 "Active wakeup sources" > /tmp/callback.output
+./suspend-blocker -R /tmp/callback.rules -r -c 5 custom.rlog | \
+	grep -A3 "Active wakeup sources" | diff /tmp/callback.output -
+if [ $? -eq 0 ]; then
+	echo "custom.rlog -R -c: PASSED"
+else
+	echo "custom.rlog -R -c: FAILED"
+fi
+rm -f /tmp/callback.rules /tmp/callback.output
+
+#
+#  Suspends timed by kernel and then PM clocks, a huge gap between them
+#  and huge durations must land in the last bins of the -S sketches
+#
+TZ=UTC ./suspend-blocker -v -S -p mixed-clock.rlog > /tmp/mixed-clock.rlog.output
+diff mixed-clock.rlog.output /tmp/mixed-clock.rlog.output
+if [ $? -eq 0 ]; then
+	echo "mixed-clock.rlog -S: PASSED"
+else
+	echo "mixed-clock.rlog -S: FAILED"
+fi